@@ -3,24 +3,42 @@
 #ifndef GAIM_PLUGINS
 #define GAIM_PLUGINS
 #endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg() */
+#endif
 
 #include "ipmsg.h"
+#include "ipmsg_utf8.h"
+#include "ipmsg_pcap.h"
+#include "ipmsg_intern.h"
+#ifdef IPMSG_HAVE_IO_URING
+#include "ipmsg_uring.h"
+#endif
 
 #include <plugin.h>
 #include <prpl.h>
 #include <version.h>
 #include <accountopt.h>
+#include <request.h>
 #include <gaim/debug.h>
 
+#include <stdio.h>
 #include <string.h>
+#include <stddef.h> /* offsetof() */
+#include <errno.h>
+#include <time.h>
 
 #include <unistd.h>
 
 #include <sys/param.h> /* htons() */
 #include <sys/types.h> /* socket() */
 #include <sys/socket.h> /* socket() */
+#include <sys/uio.h> /* struct iovec */
 #include <netinet/in.h> /* inet_addr() INADDR_ANY */
 #include <arpa/inet.h> /* inet_addr() */
+#include <fcntl.h> /* O_NONBLOCK */
+#include <sys/stat.h> /* stat() */
+#include <netinet/ip.h> /* IPTOS_* */
 
 #define IPMSG_DEFAULT_USERNAME  "nobody"
 #define IPMSG_DEFAULT_ENCODING  "UTF-8"
@@ -32,6 +50,114 @@
 
 #define IPMSG_PRPL_ID "prpl-ipmsg"
 
+#define IPMSG_MAX_PACKET 16384
+
+/* delivery latency tracing */
+#define IPMSG_HIST_BUCKETS  24  /* log2 microsecond buckets, the last one is open */
+#define IPMSG_DEDUPE_SLOTS  256 /* must be a power of two */
+#define IPMSG_ACK_TIMEOUT   5   /* seconds after it went out before an unacknowledged SENDMSG is sent again */
+#define IPMSG_ACK_RETRIES   3   /* resends before it counts as lost */
+
+/* send lanes, in priority order: control traffic never queues behind
+ * messages, and one-to-one messages never queue behind an announcement */
+#define IPMSG_LANE_TICK_MS       10
+#define IPMSG_LANE_CONTROL_TOS   0xc0 /* DSCP CS6 */
+#define IPMSG_LANE_CONTROL_PRIO  6
+#define IPMSG_LANE_CONTROL_RATE  200  /* packets per second */
+#define IPMSG_LANE_CONTROL_BURST 50
+#define IPMSG_LANE_BULK_TOS      0x00 /* best effort */
+#define IPMSG_LANE_BULK_PRIO     0
+#define IPMSG_LANE_BULK_RATE     50
+#define IPMSG_LANE_BULK_BURST    10
+#define IPMSG_LANE_ANNOUNCE_TOS   0x20 /* DSCP CS1, lower effort */
+#define IPMSG_LANE_ANNOUNCE_PRIO  0
+#define IPMSG_LANE_ANNOUNCE_RATE  20
+#define IPMSG_LANE_ANNOUNCE_BURST 5
+
+/* long bodies over TCP, a private extension negotiated through SENDINFO: see
+ * the long messages section. The option bit is never advertised, and only
+ * goes out on a SENDMSG to a peer whose SENDINFO carried IPMSG_LONGMSG_TAG. */
+#define IPMSG_LONGMSGOPT         0x40000000UL
+#define IPMSG_LONGMSG_TAG        " longmsg:" /* followed by our TCP port */
+#define IPMSG_LONGMSG_STREAMS    8       /* concurrent fetches we serve, and make */
+#define IPMSG_LONGMSG_CHUNK      16384   /* first fetch buffer, doubled as the body comes in */
+#define IPMSG_LONGMSG_THRESHOLD  1200    /* larger bodies would be IP fragmented */
+#define IPMSG_LONGMSG_MAX        (1 << 20)
+#define IPMSG_LONGMSG_KEEP       120     /* seconds a body waits to be fetched */
+#define IPMSG_LONGMSG_TIMEOUT    30      /* seconds for one TCP transfer */
+
+/* GETINFO/GETABSENCEINFO answers cached per peer */
+#define IPMSG_INFO_TTL           300 /* seconds an answer counts as fresh */
+#define IPMSG_INFO_QUERY_TIMEOUT 5   /* seconds one outstanding query is shared */
+
+/* inbound queue between socket draining and delivery */
+#define IPMSG_DRAIN_BATCH     32   /* datagrams per recvmmsg() */
+#define IPMSG_DRAIN_MAX       256  /* datagrams per wakeup before delivery gets a turn */
+#define IPMSG_INQ_BATCH       64   /* datagrams delivered per main loop pass */
+#define IPMSG_INQ_HIGH        1024 /* default watermarks, in queued datagrams */
+#define IPMSG_INQ_LOW         256
+#define IPMSG_RCVBUF_MIN      (256 * 1024)
+#define IPMSG_RCVBUF_MAX      (8 * 1024 * 1024)
+#define IPMSG_RCVBUF_PER_PEER 4096 /* an ANSENTRY storm plus a message each */
+#define IPMSG_URING_BUFS      64   /* provided receive buffers, a power of two */
+#define IPMSG_URING_BUF_SLACK 256  /* room for the address and control headers */
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+#define IPMSG_HAVE_RECVMMSG 1
+#else
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+/* rediscovery: unicast BR_ENTRY to known peers before broadcasting */
+#define IPMSG_REDISCOVER_BATCH     32   /* probes per wheel tick */
+#define IPMSG_REDISCOVER_WAIT      3    /* seconds for answers after the last probe */
+#define IPMSG_REDISCOVER_MIN_RATE  0.5  /* answered share below which the run ends in a broadcast */
+#define IPMSG_REDISCOVER_LATE      600  /* seconds until the broadcast a well-answered run still owes */
+#define IPMSG_REDISCOVER_SAVED_TTL 3600 /* seconds a saved peer list stays worth trying */
+#define IPMSG_REDISCOVER_MAX_SAVED 4096
+
+/* per-source flood protection, checked before a datagram is parsed */
+#define IPMSG_FLOOD_RATE    20  /* datagrams per second one host may sustain */
+#define IPMSG_FLOOD_BURST   60
+#define IPMSG_FLOOD_STRIKES 30  /* datagrams over budget before the host is muted */
+#define IPMSG_FLOOD_MUTE    30  /* seconds */
+#define IPMSG_FLOOD_IDLE    120 /* seconds before a quiet host's bucket is dropped */
+
+/* discovered peers are added to the buddy list in batches */
+#define IPMSG_BLIST_BATCH_MS 500
+
+/* virtual roster: peers we talked to within this many seconds get a blist node */
+#define IPMSG_ROSTER_RECENT          3600
+#define IPMSG_DIRECTORY_MAX_RESULTS  500
+#define IPMSG_TRANSIENT_SETTING      "ipmsg-transient"
+
+/* sealed messages, expired a whole generation at a time */
+#define IPMSG_SEAL_GEN_PERIOD  600   /* seconds one generation collects entries */
+#define IPMSG_SEAL_TTL         86400 /* seconds before an unanswered entry goes */
+#define IPMSG_SEAL_MAX         4096  /* entries kept at most, oldest generation goes first */
+
+/* traffic capture ring, about 2MB when enabled */
+#define IPMSG_CAPTURE_SLOTS         1024
+#define IPMSG_CAPTURE_SNAPLEN       2048
+#define IPMSG_CAPTURE_ERROR_HOLDOFF 60 /* seconds between dumps triggered by errors */
+
+/* timer wheel: one gaim timeout drives every per-peer deadline */
+#define IPMSG_WHEEL_SLOTS   64 /* must be a power of two */
+#define IPMSG_WHEEL_TICK_MS 1000
+
+/* liveness sweep, all times in wheel ticks (seconds) */
+#define IPMSG_LIVE_MIN_INTERVAL   60  /* never probe a quiet peer more often */
+#define IPMSG_LIVE_MAX_INTERVAL   900 /* never leave a quiet peer unchecked longer */
+#define IPMSG_LIVE_TARGET_RATE    2   /* probes per second we aim to stay under */
+#define IPMSG_LIVE_MAX_RATE       8   /* probes per second we never exceed */
+#define IPMSG_LIVE_PROBE_TIMEOUT  10  /* wait for an answer before the next probe */
+#define IPMSG_LIVE_MAX_PROBES     3   /* unanswered probes before a peer is gone */
+#define IPMSG_LIVE_CHURN_PERIOD   60  /* churn is sampled once a minute */
+#define IPMSG_LIVE_CHURN_SCALE    10.0 /* joins+leaves per minute that halve the interval */
+
 #ifdef ENABLE_NLS
 #  include <locale.h>
 #  include <libintl.h>
@@ -51,26 +177,493 @@
 #define SET_IOV(v,next,base,len) (void)((v)->iov_next = (next), (v)->iov_base = (base), (v)->iov_len = (len))
 
 
-typedef char ipmsg_uniqid[30];
+#define IPMSG_TIMER_ENTRY(ptr, type, member) ((type *) ((char *) (ptr) - offsetof(type, member)))
+
+typedef struct _ipmsg_data ipmsg_data;
+
+typedef char ipmsg_uniqid[128];
 typedef struct {
 	const char *name;
 	const char *host;
 	int port;
 } ipmsg_user;
+
+typedef struct _ipmsg_timer ipmsg_timer;
+typedef void (*ipmsg_timer_func)(ipmsg_data *sd, ipmsg_timer *t);
+struct _ipmsg_timer {
+	ipmsg_timer *next;
+	ipmsg_timer *prev;
+	unsigned long expires; /* wheel tick */
+	ipmsg_timer_func func;
+};
+
+typedef struct {
+	ipmsg_timer slots[IPMSG_WHEEL_SLOTS]; /* list heads */
+	unsigned long now;                    /* ticks since login */
+	guint source;
+} ipmsg_wheel;
+
+typedef struct {
+	unsigned long version;
+	unsigned long packetno;
+	const char *user;
+	const char *host;
+	unsigned long cmd;
+	const char *extra; /* may carry more NUL separated fields */
+	size_t extra_len;
+	struct timespec rx;     /* kernel receive time */
+	struct timespec parsed;
+	struct timespec dequeued; /* left the inbound queue */
+} ipmsg_packet;
+
+typedef struct {
+	char *text;            /* UTF-8, NULL until the first answer */
+	unsigned long fetched; /* wheel tick of the answer */
+	unsigned long asked;   /* wheel tick of the outstanding query, 0 if none */
+} ipmsg_info;
+
+typedef struct {
+	ipmsg_timer live;
+	ipmsg_timer info_wait;   /* get_info with nothing cached waits for the answer */
+	struct sockaddr_in addr;
+	ipmsg_user user;         /* name and host interned in sd->names */
+	const char *uid;         /* interned too */
+	unsigned long caps;      /* option bits from the peer's entry packets */
+	int longmsg_port;        /* from its SENDINFO, 0 unless it fetches long messages */
+	unsigned long last_seen; /* wheel tick of the last packet from this peer */
+	int probes;              /* unanswered liveness probes */
+	ipmsg_info version;      /* SENDINFO */
+	ipmsg_info absence;      /* SENDABSENCEINFO */
+	unsigned long last_chat; /* wheel tick of the last message either way, 0 if none */
+	char *search;            /* casefolded "name host address" for the LAN directory */
+} ipmsg_peer;
+
+typedef struct {
+	ipmsg_timer churn_timer;
+	unsigned int tokens;         /* probe budget, refilled every tick */
+	unsigned long refilled;      /* tick of the last refill */
+	unsigned int churn_events;   /* joins and leaves in the current period */
+	double churn;                /* smoothed joins and leaves per minute */
+	unsigned int interval;       /* current probe interval */
+} ipmsg_liveness;
+
+typedef enum {
+	IPMSG_LANE_CONTROL,
+	IPMSG_LANE_BULK,
+	IPMSG_LANE_ANNOUNCE,
+	IPMSG_LANES
+} ipmsg_lane_id;
+
+typedef struct {
+	struct sockaddr_in addr;
+	unsigned long packetno;
+	gboolean ack;  /* a pending ack waits for this packet to go out */
+	size_t len;
+	char data[1]; /* wire bytes, len long */
+} ipmsg_outpkt;
+
+typedef struct {
+	GQueue *queue;   /* ipmsg_outpkt *, waiting for tokens */
+	int tos;
+	int priority;
+	double rate;     /* packets per second */
+	double burst;
+	double tokens;
+	struct timespec refilled;
+	unsigned long sent;
+	unsigned long waited;    /* packets that could not go out at once */
+	unsigned int max_depth;
+} ipmsg_lane;
+
+typedef struct {
+	unsigned long buckets[IPMSG_HIST_BUCKETS];
+	unsigned long count;
+	guint64 sum_us;
+	guint64 max_us;
+} ipmsg_histogram;
+
+typedef struct {
+	ipmsg_timer timeout;
+	unsigned long packetno;
+	struct sockaddr_in to;    /* only its RECVMSG completes the ack */
+	struct timespec sent;     /* last transmission */
+	unsigned long cmd;        /* what to send again */
+	char *msg;
+	char *who;                /* conversation told when it is lost */
+	int retries;
+} ipmsg_pending_ack;
+
+typedef struct {
+	in_addr_t addr;
+	unsigned long packetno;
+} ipmsg_dedupe_slot;
+
+typedef struct {
+	ipmsg_histogram parse;   /* kernel receive -> parsed */
+	ipmsg_histogram queue;   /* parsed -> left the inbound queue */
+	ipmsg_histogram dedupe;  /* left the inbound queue -> duplicate check done */
+	ipmsg_histogram deliver; /* duplicate check done -> serv_got_im returned */
+	ipmsg_histogram total;   /* kernel receive -> serv_got_im returned */
+	ipmsg_histogram ack;     /* SENDMSG sent -> RECVMSG received */
+	unsigned long kernel_stamps; /* packets that carried SO_TIMESTAMPNS */
+	unsigned long duplicates;
+	unsigned long acks_resent;
+	unsigned long acks_lost;
+} ipmsg_latency;
+
+typedef struct {
+	ipmsg_timer expire;
+	unsigned long packetno;
+	struct sockaddr_in addr; /* the only peer allowed to fetch it */
+	char *body;
+	size_t len;
+} ipmsg_longmsg;
+
+typedef struct {
+	ipmsg_data *sd;
+	ipmsg_timer timeout;
+	int fd;
+	guint inpa;
+	gboolean serving;         /* TRUE on the sending side */
+	struct sockaddr_in addr;
+	char line[24];            /* the request, a decimal packet number and '\n' */
+	size_t line_len;
+	ipmsg_longmsg *msg;       /* serving: the body being written */
+	size_t done;              /* bytes written or read so far */
+	ipmsg_packet pkt;         /* fetching: descriptor header, strings unset */
+	ipmsg_uniqid who;
+	struct timespec deduped;
+	size_t want;
+	size_t size;              /* of body, grows up to want */
+	char *body;
+} ipmsg_stream;
+
+typedef struct _ipmsg_sealed ipmsg_sealed;
+typedef struct _ipmsg_seal_gen ipmsg_seal_gen;
+
+typedef struct {
+	in_addr_t addr;
+	unsigned long packetno;
+	gboolean outgoing;
+} ipmsg_seal_key;
+
+struct _ipmsg_sealed {
+	ipmsg_seal_key key;
+	ipmsg_sealed *next;    /* generation list */
+	ipmsg_sealed *prev;
+	ipmsg_seal_gen *gen;
+	ipmsg_data *sd;
+	struct sockaddr_in addr;
+	ipmsg_uniqid who;
+	char *body;            /* incoming, until opened */
+	size_t len;
+	time_t mtime;
+	void *request;         /* incoming, the envelope dialog */
+};
+
+struct _ipmsg_seal_gen {
+	ipmsg_timer expire;
+	unsigned long opened;  /* wheel tick the generation started */
+	ipmsg_sealed *first;
+	unsigned int count;
+};
+
+typedef struct {
+	unsigned long longmsg_sent;
+	unsigned long longmsg_fetched;
+	unsigned long longmsg_failed;
+	unsigned long longmsg_refused; /* streams turned away at IPMSG_LONGMSG_STREAMS */
+} ipmsg_longmsg_stats;
+
+typedef struct {
+	unsigned long sealed_in;
+	unsigned long sealed_out;
+	unsigned long opened;      /* read receipts, both directions */
+	unsigned long deleted;
+	unsigned long expired;
+} ipmsg_seal_stats;
+
+typedef enum {
+	IPMSG_INQ_SHED_CHAT,  /* above the high watermark only chat is dropped */
+	IPMSG_INQ_DROP_NEWEST /* above the high watermark everything new is dropped */
+} ipmsg_inq_policy;
+
+typedef struct {
+	struct sockaddr_in addr;
+	ipmsg_packet pkt;    /* points into data */
+	size_t len;
+	char data[1];
+} ipmsg_inpkt;
+
+typedef struct {
+	GQueue *control;     /* ipmsg_inpkt *, acks and presence, delivered first */
+	GQueue *chat;        /* ipmsg_inpkt *, SENDMSG */
+	guint high;
+	guint low;
+	ipmsg_inq_policy policy;
+	gboolean shedding;   /* crossed high, not yet back under low */
+	guint source;        /* delivery timeout while anything is queued */
+} ipmsg_inq;
+
+typedef struct {
+	struct mmsghdr msgs[IPMSG_DRAIN_BATCH];
+	struct iovec iov[IPMSG_DRAIN_BATCH];
+	struct sockaddr_in addr[IPMSG_DRAIN_BATCH];
+	char cmsg[IPMSG_DRAIN_BATCH][CMSG_SPACE(sizeof(struct timespec))];
+	char bufs[IPMSG_DRAIN_BATCH][IPMSG_MAX_PACKET + 1];
+} ipmsg_rx;
+
+typedef struct {
+	unsigned long dropped_chat;
+	unsigned long dropped_control;
+	unsigned long max_depth;
+	unsigned long drains;      /* readable wakeups */
+	unsigned long batches;     /* recvmmsg() calls that returned datagrams */
+} ipmsg_inq_stats;
+
+typedef struct {
+	unsigned long addr;          /* in_addr, network order */
+	double tokens;
+	struct timespec refilled;
+	unsigned int strikes;        /* datagrams over budget since the bucket was last full */
+	unsigned long muted_until;   /* wheel tick, 0 if not muted */
+	unsigned long last_seen;     /* wheel tick */
+} ipmsg_flood_bucket;
+
+typedef struct {
+	unsigned long dropped;
+	unsigned long mutes;
+} ipmsg_flood_stats;
+
 typedef struct {
+	GArray *targets;          /* struct sockaddr_in, in probing order */
+	GHashTable *probed;       /* struct sockaddr_in * -> answered, owns the keys */
+	guint next;               /* first target not yet probed */
+	guint answered;
+	gboolean waiting;         /* all probed, collecting answers */
+	ipmsg_timer timer;
+	ipmsg_timer late;         /* deferred broadcast after a well-answered run */
+} ipmsg_rediscovery;
+
+typedef struct {
+	unsigned long runs;
+	unsigned long probes;
+	unsigned long answers;
+	unsigned long fallbacks;  /* runs below IPMSG_REDISCOVER_MIN_RATE, broadcast at once */
+	unsigned long deferred;   /* runs whose broadcast waited IPMSG_REDISCOVER_LATE */
+} ipmsg_rediscovery_stats;
+
+typedef struct {
+	unsigned long batches;
+	unsigned long created;
+	unsigned long aliased;     /* existing buddies whose alias changed */
+	unsigned long unchanged;
+	unsigned long virtualized; /* presence updates kept out of the blist */
+	unsigned long dropped;     /* transient buddies removed again */
+} ipmsg_blist_stats;
+
+typedef struct {
+	unsigned long packets_in;
+	unsigned long packets_out;
+	unsigned long bad_packets;
+	unsigned long probes_sent;
+	unsigned long probes_deferred;
+	unsigned long peers_expired;
+	unsigned long info_queries;
+	unsigned long info_shared;   /* lookups that joined a query already out */
+	unsigned long info_hits;     /* lookups answered from the cache */
+	ipmsg_longmsg_stats longmsg;
+	ipmsg_seal_stats seal;
+	ipmsg_blist_stats blist;
+	ipmsg_flood_stats flood;
+	ipmsg_inq_stats inq;
+	ipmsg_rediscovery_stats rediscover;
+} ipmsg_stats;
+
+struct _ipmsg_data {
 	GaimAccount *account;
 	ipmsg_user user;
 	ipmsg_uniqid uid;
 	int fd;
 	long msgid;
-} ipmsg_data;
+
+	ipmsg_intern_pool *names;      /* user, host and uid strings */
+	GHashTable *peers;        /* struct sockaddr_in * -> ipmsg_peer *, owns the peers */
+	GHashTable *peers_by_uid; /* uid -> ipmsg_peer * */
+	ipmsg_wheel wheel;
+	ipmsg_liveness live;
+	ipmsg_stats stats;
+	ipmsg_latency latency;
+	GHashTable *pending_acks; /* packetno -> ipmsg_pending_ack * */
+	unsigned long caps;       /* option bits we advertise */
+	int tcp_fd;               /* long message listener, -1 if none */
+	int tcp_port;
+	guint tcp_inpa;
+	GHashTable *longmsgs;     /* packetno -> ipmsg_longmsg *, bodies waiting to be fetched */
+	GList *streams;           /* ipmsg_stream * in progress */
+	guint serving;            /* how many of them we accepted */
+	guint fetching;           /* and how many we opened */
+	GHashTable *sealed;       /* ipmsg_seal_key * -> ipmsg_sealed * */
+	GQueue *seal_gens;        /* ipmsg_seal_gen *, oldest first */
+	unsigned int sealed_count;
+	GHashTable *blist_pending; /* uids waiting for the next blist batch */
+	guint blist_source;
+	gboolean virtual_roster;   /* only pinned and recent peers get blist nodes */
+	ipmsg_dedupe_slot dedupe[IPMSG_DEDUPE_SLOTS];
+	ipmsg_rx *rx;             /* receive buffers for one drain batch */
+#ifdef IPMSG_HAVE_IO_URING
+	ipmsg_uring *uring;       /* NULL when the kernel lacks io_uring, then rx is used */
+#endif
+	ipmsg_inq inq;
+	int rcvbuf_asked;         /* last SO_RCVBUF we asked for */
+	int rcvbuf;               /* what the kernel granted */
+	ipmsg_rediscovery rediscover; /* targets is NULL unless a run is going */
+	GHashTable *flood;        /* in_addr -> ipmsg_flood_bucket * */
+	ipmsg_timer flood_sweep;
+
+	ipmsg_lane lanes[IPMSG_LANES];
+	int lane_marked;              /* lane the socket is currently marked for, -1 if none */
+	guint lane_source;            /* pacing timeout, only while a lane has a backlog */
+
+	ipmsg_capture *capture;       /* NULL unless the account enables capturing */
+	unsigned long capture_dumped; /* wheel tick of the last dump on error */
+};
 
 static GaimPlugin *_ipmsg_plugin = NULL;
 
+/* buddy names are "user@host". Before the peer table they were the first few
+ * bytes of the user name, so buddies added by older versions come back as new
+ * ones and the old entries can be deleted. */
 static void ipmsg_uniqid_from_user(ipmsg_uniqid uid, const ipmsg_user *user) /* {{{ ipmsg_uniqid */
 {
-	snprintf(uid, sizeof(uid) - 1, user->name, user->host, user->port);
-	uid[sizeof(uid)] = '\0';
+	g_snprintf(uid, sizeof(ipmsg_uniqid), "%s@%s", user->name, user->host);
+}
+/* }}} */
+
+/* {{{ timer wheel */
+static void ipmsg_timer_del(ipmsg_timer *t)
+{
+	if (t->next != NULL) {
+		t->prev->next = t->next;
+		t->next->prev = t->prev;
+		t->next = t->prev = NULL;
+	}
+}
+
+static void ipmsg_timer_add(ipmsg_data *sd, ipmsg_timer *t, unsigned long ticks)
+{
+	ipmsg_timer *head;
+
+	ipmsg_timer_del(t);
+	if (ticks == 0) {
+		ticks = 1;
+	}
+	t->expires = sd->wheel.now + ticks;
+	head = &sd->wheel.slots[t->expires & (IPMSG_WHEEL_SLOTS - 1)];
+	t->next = head;
+	t->prev = head->prev;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+static gboolean ipmsg_wheel_tick(gpointer data)
+{
+	ipmsg_data *sd = data;
+	ipmsg_timer due;
+	ipmsg_timer *head, *t, *next;
+
+	sd->wheel.now ++;
+	head = &sd->wheel.slots[sd->wheel.now & (IPMSG_WHEEL_SLOTS - 1)];
+
+	/* detach first, callbacks may re-arm into this very slot */
+	due.next = due.prev = &due;
+	for (t = head->next; t != head; t = next) {
+		next = t->next;
+		if (t->expires <= sd->wheel.now) {
+			ipmsg_timer_del(t);
+			t->next = &due;
+			t->prev = due.prev;
+			due.prev->next = t;
+			due.prev = t;
+		}
+	}
+
+	while ((t = due.next) != &due) {
+		ipmsg_timer_del(t);
+		t->func(sd, t);
+	}
+	return TRUE;
+}
+
+static void ipmsg_wheel_init(ipmsg_data *sd)
+{
+	int i;
+
+	for (i = 0; i < IPMSG_WHEEL_SLOTS; i ++) {
+		sd->wheel.slots[i].next = sd->wheel.slots[i].prev = &sd->wheel.slots[i];
+	}
+	sd->wheel.now = 0;
+	sd->wheel.source = gaim_timeout_add(IPMSG_WHEEL_TICK_MS, ipmsg_wheel_tick, sd);
+}
+
+static void ipmsg_wheel_free(ipmsg_data *sd)
+{
+	if (sd->wheel.source) {
+		gaim_timeout_remove(sd->wheel.source);
+		sd->wheel.source = 0;
+	}
+}
+/* }}} */
+
+/* {{{ latency histograms */
+static guint64 ipmsg_elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+	gint64 us = (gint64) (to->tv_sec - from->tv_sec) * 1000000 + (to->tv_nsec - from->tv_nsec) / 1000;
+	return us > 0 ? us : 0;
+}
+
+static void ipmsg_histogram_add(ipmsg_histogram *h, const struct timespec *from, const struct timespec *to)
+{
+	guint64 us = ipmsg_elapsed_us(from, to);
+	int b = 0;
+
+	while (b < IPMSG_HIST_BUCKETS - 1 && (us >> b) > 1) {
+		b ++;
+	}
+	h->buckets[b] ++;
+	h->count ++;
+	h->sum_us += us;
+	h->max_us = MAX(h->max_us, us);
+}
+
+/* upper bound of the bucket holding the given fraction of samples */
+static guint64 ipmsg_histogram_quantile(const ipmsg_histogram *h, double q)
+{
+	unsigned long want = (unsigned long) (h->count * q);
+	unsigned long seen = 0;
+	int b;
+
+	for (b = 0; b < IPMSG_HIST_BUCKETS; b ++) {
+		seen += h->buckets[b];
+		if (seen > want) {
+			return MIN((guint64) 2 << b, h->max_us);
+		}
+	}
+	return h->max_us;
+}
+
+static void ipmsg_histogram_print(GString *str, const char *title, const ipmsg_histogram *h)
+{
+	if (h->count == 0) {
+		g_string_append_printf(str, "<b>%s</b> -<br>", title);
+		return;
+	}
+	g_string_append_printf(str, "<b>%s</b> n=%lu mean=%luus p50&lt;=%luus p99&lt;=%luus max=%luus<br>",
+	                       title, h->count,
+	                       (unsigned long) (h->sum_us / h->count),
+	                       (unsigned long) ipmsg_histogram_quantile(h, 0.5),
+	                       (unsigned long) ipmsg_histogram_quantile(h, 0.99),
+	                       (unsigned long) h->max_us);
 }
 /* }}} */
 
@@ -84,82 +677,2169 @@ static void ipmsg_clear_offline(GaimAccount *account)
 {
 }
 
-static GaimBuddy *ipmsg_find_buddy(GaimAccount *account, const ipmsg_user *user)
+static GaimBuddy *ipmsg_find_buddy(GaimAccount *account, const ipmsg_user *user)
+{
+	ipmsg_uniqid uid;
+	ipmsg_uniqid_from_user(uid, user);
+	return gaim_find_buddy(account, uid);
+}
+
+/* {{{ buddy list materialization
+ * Discovered peers are queued and turned into buddy nodes from one timeout
+ * every IPMSG_BLIST_BATCH_MS. Saving blist.xml is left to gaim's own save
+ * timer, which the batch merely gives a chance to cover the whole burst.
+ * The user name is the buddy's server alias, so the local alias stays the
+ * user's own; new buddies get it directly, and serv_got_alias() is only
+ * called when an existing one changed, as it also writes to conversations.
+ */
+static GaimBuddy *ipmsg_blist_materialize(ipmsg_data *sd, GaimGroup **group, const ipmsg_peer *peer)
+{
+	GaimBuddy *b = gaim_find_buddy(sd->account, peer->uid);
+
+	if (b == NULL) {
+		if (*group == NULL && (*group = gaim_find_group(IPMSG_GROUPNAME)) == NULL) {
+			*group = gaim_group_new(IPMSG_GROUPNAME);
+			gaim_blist_add_group(*group, NULL);
+		}
+		b = gaim_buddy_new(sd->account, peer->uid, NULL);
+		gaim_blist_add_buddy(b, NULL, *group, NULL);
+		gaim_blist_server_alias_buddy(b, peer->user.name);
+		if (sd->virtual_roster) {
+			/* goes away with the peer unless the user pins it */
+			gaim_blist_node_set_bool(&b->node, IPMSG_TRANSIENT_SETTING, TRUE);
+		}
+		sd->stats.blist.created ++;
+	}
+	else if (b->server_alias == NULL || strcmp(b->server_alias, peer->user.name) != 0) {
+		if (b->server_alias == NULL && b->alias != NULL && strcmp(b->alias, peer->user.name) == 0) {
+			/* created with the user name as local alias, which hid renames */
+			gaim_blist_alias_buddy(b, NULL);
+		}
+		serv_got_alias(gaim_account_get_connection(sd->account), peer->uid, peer->user.name);
+		sd->stats.blist.aliased ++;
+	}
+	else {
+		sd->stats.blist.unchanged ++;
+	}
+
+	gaim_prpl_got_user_status(sd->account, peer->uid, IPMSG_STATUS_ONLINE, NULL);
+	return b;
+}
+
+typedef struct {
+	ipmsg_data *sd;
+	GaimGroup *group;
+} ipmsg_blist_batch;
+
+static gboolean ipmsg_blist_flush_one(gpointer key, gpointer value, gpointer user_data)
+{
+	ipmsg_blist_batch *batch = user_data;
+	ipmsg_peer *peer = g_hash_table_lookup(batch->sd->peers_by_uid, key);
+
+	/* gone or renamed since it was queued */
+	if (peer != NULL) {
+		ipmsg_blist_materialize(batch->sd, &batch->group, peer);
+	}
+	return TRUE;
+}
+
+static gboolean ipmsg_blist_flush(gpointer data)
+{
+	ipmsg_data *sd = data;
+	ipmsg_blist_batch batch;
+
+	batch.sd = sd;
+	batch.group = NULL;
+	g_hash_table_foreach_remove(sd->blist_pending, ipmsg_blist_flush_one, &batch);
+	sd->stats.blist.batches ++;
+	sd->blist_source = 0;
+	return FALSE;
+}
+
+static void ipmsg_blist_add_user(ipmsg_data *sd, const ipmsg_peer *peer)
+{
+	GaimBuddy *b = ipmsg_find_buddy(sd->account, &peer->user);
+
+	/* the common case once the roster is built: nothing to batch */
+	if (b != NULL && b->server_alias != NULL && strcmp(b->server_alias, peer->user.name) == 0) {
+		sd->stats.blist.unchanged ++;
+		gaim_prpl_got_user_status(sd->account, peer->uid, IPMSG_STATUS_ONLINE, NULL);
+		return;
+	}
+	if (b == NULL && sd->virtual_roster &&
+	    (peer->last_chat == 0 || sd->wheel.now - peer->last_chat >= IPMSG_ROSTER_RECENT)) {
+		/* reachable through the LAN directory */
+		sd->stats.blist.virtualized ++;
+		return;
+	}
+	g_hash_table_replace(sd->blist_pending, g_strdup(peer->uid), NULL);
+	if (sd->blist_source == 0) {
+		sd->blist_source = gaim_timeout_add(IPMSG_BLIST_BATCH_MS, ipmsg_blist_flush, sd);
+	}
+}
+
+static void ipmsg_blist_chatting(ipmsg_data *sd, const char *who)
+{
+	ipmsg_peer *peer = g_hash_table_lookup(sd->peers_by_uid, who);
+
+	if (peer != NULL) {
+		peer->last_chat = MAX(sd->wheel.now, 1);
+		if (sd->virtual_roster) {
+			ipmsg_blist_add_user(sd, peer);
+		}
+	}
+}
+
+static void ipmsg_blist_pin(ipmsg_data *sd, const ipmsg_peer *peer)
+{
+	GaimGroup *group = NULL;
+	GaimBuddy *b = ipmsg_blist_materialize(sd, &group, peer);
+
+	gaim_blist_node_set_bool(&b->node, IPMSG_TRANSIENT_SETTING, FALSE);
+}
+
+static void ipmsg_blist_drop(ipmsg_data *sd, const char *uid)
+{
+	GaimBuddy *b = gaim_find_buddy(sd->account, uid);
+
+	if (b != NULL && gaim_blist_node_get_bool(&b->node, IPMSG_TRANSIENT_SETTING)) {
+		gaim_blist_remove_buddy(b);
+		sd->stats.blist.dropped ++;
+	}
+}
+
+/* transient buddies left over from the last session */
+static void ipmsg_blist_drop_transient(ipmsg_data *sd)
+{
+	GaimGroup *g = gaim_find_group(IPMSG_GROUPNAME);
+	GaimBlistNode *cnode, *bnode;
+	GSList *drop = NULL;
+
+	if (g == NULL) {
+		return;
+	}
+	/* removing the last buddy frees its contact, so collect first */
+	for (cnode = g->node.child; cnode != NULL; cnode = cnode->next) {
+		for (bnode = cnode->child; bnode != NULL; bnode = bnode->next) {
+			if (GAIM_BLIST_NODE_IS_BUDDY(bnode) && ((GaimBuddy *) bnode)->account == sd->account &&
+			    gaim_blist_node_get_bool(bnode, IPMSG_TRANSIENT_SETTING)) {
+				drop = g_slist_prepend(drop, bnode);
+			}
+		}
+	}
+	while (drop != NULL) {
+		gaim_blist_remove_buddy(drop->data);
+		sd->stats.blist.dropped ++;
+		drop = g_slist_delete_link(drop, drop);
+	}
+}
+
+static void ipmsg_blist_init(ipmsg_data *sd)
+{
+	sd->blist_pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	sd->virtual_roster = gaim_account_get_bool(sd->account, "virtual_roster", FALSE);
+	ipmsg_blist_drop_transient(sd);
+}
+
+static void ipmsg_blist_free(ipmsg_data *sd)
+{
+	if (sd->blist_source != 0) {
+		gaim_timeout_remove(sd->blist_source);
+		sd->blist_source = 0;
+	}
+	if (sd->blist_pending != NULL) {
+		g_hash_table_destroy(sd->blist_pending);
+		sd->blist_pending = NULL;
+	}
+}
+/* }}} */
+
+/* {{{ traffic capture */
+static char *ipmsg_capture_save(ipmsg_data *sd)
+{
+	struct sockaddr_in local;
+	char *basename;
+	char *filename;
+
+	memset(&local, '\0', sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = INADDR_ANY;
+	local.sin_port = htons(sd->user.port);
+
+	basename = g_strdup_printf("ipmsg-%lu.pcap", (unsigned long) time(NULL));
+	filename = g_build_filename(gaim_user_dir(), basename, NULL);
+	g_free(basename);
+
+	if (!ipmsg_capture_dump(sd->capture, &local, filename)) {
+		gaim_debug_error("ipmsg", "capture dump to %s failed: %s\n", filename, strerror(errno));
+		g_free(filename);
+		return NULL;
+	}
+	gaim_debug_info("ipmsg", "%u datagrams captured to %s\n", ipmsg_capture_count(sd->capture), filename);
+	return filename;
+}
+
+static void ipmsg_capture_error(ipmsg_data *sd, const char *what)
+{
+	int saved = errno;
+
+	if (sd->capture == NULL || ipmsg_capture_count(sd->capture) == 0) {
+		return;
+	}
+	if (sd->capture_dumped != 0 && sd->wheel.now - sd->capture_dumped < IPMSG_CAPTURE_ERROR_HOLDOFF) {
+		return;
+	}
+	gaim_debug_warning("ipmsg", "%s: %s, dumping capture\n", what, strerror(saved));
+	sd->capture_dumped = MAX(sd->wheel.now, 1);
+	g_free(ipmsg_capture_save(sd));
+	errno = saved;
+}
+/* }}} */
+
+/* {{{ send lanes */
+static void ipmsg_pending_ack_sent(ipmsg_data *sd, const ipmsg_outpkt *op);
+
+static void ipmsg_lane_mark(ipmsg_data *sd, ipmsg_lane_id id)
+{
+	ipmsg_lane *lane = &sd->lanes[id];
+
+	if (sd->lane_marked == id) {
+		return;
+	}
+	/* setting IP_TOS also resets the priority on Linux, so priority goes second */
+	if (setsockopt(sd->fd, IPPROTO_IP, IP_TOS, &lane->tos, sizeof(lane->tos)) < 0) {
+		gaim_debug_warning("ipmsg", "IP_TOS: %s\n", strerror(errno));
+	}
+#ifdef SO_PRIORITY
+	if (setsockopt(sd->fd, SOL_SOCKET, SO_PRIORITY, &lane->priority, sizeof(lane->priority)) < 0) {
+		gaim_debug_warning("ipmsg", "SO_PRIORITY: %s\n", strerror(errno));
+	}
+#endif
+	sd->lane_marked = id;
+}
+
+static int ipmsg_lane_xmit(ipmsg_data *sd, ipmsg_lane_id id, const ipmsg_outpkt *op)
+{
+	int err;
+
+#ifdef IPMSG_HAVE_IO_URING
+	if (sd->uring != NULL) {
+		/* submitted with the rest of the batch by ipmsg_io_submit() */
+		err = ipmsg_uring_sendto(sd->uring, sd->lanes[id].tos, &op->addr, op->data, op->len) ? (int) op->len : -1;
+	}
+	else
+#endif
+	{
+		ipmsg_lane_mark(sd, id);
+		err = sendto(sd->fd, op->data, op->len, 0, (const struct sockaddr *) &op->addr, sizeof(op->addr));
+	}
+	if (sd->capture != NULL) {
+		ipmsg_capture_add(sd->capture, TRUE, &op->addr, op->data, op->len);
+	}
+	if (op->ack) {
+		/* failed or not, the ack timer runs from here */
+		ipmsg_pending_ack_sent(sd, op);
+	}
+	if (err >= 0) {
+		sd->stats.packets_out ++;
+		sd->lanes[id].sent ++;
+	}
+	else {
+		ipmsg_capture_error(sd, "sendto");
+	}
+	return err;
+}
+
+static void ipmsg_io_submit(ipmsg_data *sd)
+{
+#ifdef IPMSG_HAVE_IO_URING
+	if (sd->uring != NULL) {
+		ipmsg_uring_submit(sd->uring);
+	}
+#endif
+}
+
+static void ipmsg_lane_refill(ipmsg_lane *lane, const struct timespec *now)
+{
+	double elapsed = (now->tv_sec - lane->refilled.tv_sec) + (now->tv_nsec - lane->refilled.tv_nsec) / 1e9;
+
+	if (elapsed > 0) {
+		lane->tokens = MIN(lane->tokens + elapsed * lane->rate, lane->burst);
+		lane->refilled = *now;
+	}
+}
+
+static gboolean ipmsg_lanes_flush(gpointer data)
+{
+	ipmsg_data *sd = data;
+	struct timespec now;
+	gboolean backlog = FALSE;
+	int id;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* strictly by priority: a lane only gets a turn once those above are empty */
+	for (id = 0; id < IPMSG_LANES; id ++) {
+		ipmsg_lane *lane = &sd->lanes[id];
+		ipmsg_outpkt *op;
+
+		ipmsg_lane_refill(lane, &now);
+		while (lane->tokens >= 1 && (op = g_queue_pop_head(lane->queue)) != NULL) {
+			lane->tokens -= 1;
+			ipmsg_lane_xmit(sd, id, op);
+			g_free(op);
+		}
+		if (!g_queue_is_empty(lane->queue)) {
+			backlog = TRUE;
+			break;
+		}
+	}
+	ipmsg_io_submit(sd);
+
+	if (!backlog) {
+		sd->lane_source = 0;
+	}
+	return backlog;
+}
+
+static gboolean ipmsg_lane_blocked(ipmsg_data *sd, ipmsg_lane_id id)
+{
+	int i;
+
+	for (i = 0; i <= (int) id; i ++) {
+		if (!g_queue_is_empty(sd->lanes[i].queue)) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static int ipmsg_lane_send(ipmsg_data *sd, ipmsg_lane_id id, ipmsg_outpkt *op)
+{
+	ipmsg_lane *lane = &sd->lanes[id];
+	struct timespec now;
+	int err;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ipmsg_lane_refill(lane, &now);
+
+	/* straight out if nothing is waiting in its own lane or one above */
+	if (lane->tokens >= 1 && !ipmsg_lane_blocked(sd, id)) {
+		lane->tokens -= 1;
+		err = ipmsg_lane_xmit(sd, id, op);
+		ipmsg_io_submit(sd);
+		g_free(op);
+		return err;
+	}
+
+	g_queue_push_tail(lane->queue, op);
+	lane->waited ++;
+	lane->max_depth = MAX(lane->max_depth, g_queue_get_length(lane->queue));
+	if (sd->lane_source == 0) {
+		sd->lane_source = gaim_timeout_add(IPMSG_LANE_TICK_MS, ipmsg_lanes_flush, sd);
+	}
+	return 0;
+}
+
+static void ipmsg_lane_setup(ipmsg_lane *lane, int tos, int priority, double rate, double burst)
+{
+	lane->queue = g_queue_new();
+	lane->tos = tos;
+	lane->priority = priority;
+	lane->rate = rate;
+	lane->burst = burst;
+	lane->tokens = burst;
+	clock_gettime(CLOCK_MONOTONIC, &lane->refilled);
+}
+
+static void ipmsg_lanes_init(ipmsg_data *sd)
+{
+	ipmsg_lane_setup(&sd->lanes[IPMSG_LANE_CONTROL], IPMSG_LANE_CONTROL_TOS, IPMSG_LANE_CONTROL_PRIO,
+	                 IPMSG_LANE_CONTROL_RATE, IPMSG_LANE_CONTROL_BURST);
+	ipmsg_lane_setup(&sd->lanes[IPMSG_LANE_BULK], IPMSG_LANE_BULK_TOS, IPMSG_LANE_BULK_PRIO,
+	                 IPMSG_LANE_BULK_RATE, IPMSG_LANE_BULK_BURST);
+	ipmsg_lane_setup(&sd->lanes[IPMSG_LANE_ANNOUNCE], IPMSG_LANE_ANNOUNCE_TOS, IPMSG_LANE_ANNOUNCE_PRIO,
+	                 IPMSG_LANE_ANNOUNCE_RATE, IPMSG_LANE_ANNOUNCE_BURST);
+	sd->lane_marked = -1;
+	sd->lane_source = 0;
+}
+
+static void ipmsg_lanes_free(ipmsg_data *sd)
+{
+	ipmsg_outpkt *op;
+	int id;
+
+	if (sd->lane_source) {
+		gaim_timeout_remove(sd->lane_source);
+		sd->lane_source = 0;
+	}
+	for (id = 0; id < IPMSG_LANES; id ++) {
+		if (sd->lanes[id].queue == NULL) {
+			continue;
+		}
+		while ((op = g_queue_pop_head(sd->lanes[id].queue)) != NULL) {
+			/* pending control traffic, BR_EXIT above all, still goes out */
+			if (id == IPMSG_LANE_CONTROL && sd->fd >= 0) {
+				ipmsg_lane_xmit(sd, id, op);
+			}
+			g_free(op);
+		}
+		ipmsg_io_submit(sd);
+		g_queue_free(sd->lanes[id].queue);
+		sd->lanes[id].queue = NULL;
+	}
+}
+/* }}} */
+
+static int ipmsg_send_packet(ipmsg_data *sd, const struct sockaddr_in *sa, unsigned long packetno, unsigned long cmd, const char *msg)
+{
+#define USERNAME_MAX 64
+	char lbuf[2 + 12 + USERNAME_MAX + 1 + 64 + 1 + 12];
+	ipmsg_outpkt *op;
+	ipmsg_lane_id lane;
+	size_t hlen, mlen;
+
+	snprintf(lbuf, sizeof(lbuf), "1:%lu:%s:%s:%lu:", packetno, sd->user.name, sd->user.host, cmd);
+	hlen = strlen(lbuf);
+	mlen = strlen(msg);
+
+	op = g_malloc(sizeof(ipmsg_outpkt) + hlen + mlen);
+	op->addr = *sa;
+	op->packetno = packetno;
+	op->ack = IPMSG_GET_MODE(cmd) == IPMSG_SENDMSG && (cmd & IPMSG_SENDCHECKOPT);
+	op->len = hlen + mlen + 1;
+	memcpy(op->data, lbuf, hlen);
+	memcpy(op->data + hlen, msg, mlen + 1);
+
+	/* everything that keeps presence and acks going is control, message
+	 * bodies are bulk, and announcements to every peer come last */
+	if (IPMSG_GET_MODE(cmd) != IPMSG_SENDMSG) {
+		lane = IPMSG_LANE_CONTROL;
+	}
+	else if (cmd & IPMSG_BROADCASTOPT) {
+		lane = IPMSG_LANE_ANNOUNCE;
+	}
+	else {
+		lane = IPMSG_LANE_BULK;
+	}
+	return ipmsg_lane_send(sd, lane, op);
+}
+
+static int ipmsg_send_msg(ipmsg_data *sd, const struct sockaddr_in *sa, unsigned long cmd, const char *msg)
+{
+	return ipmsg_send_packet(sd, sa, sd->msgid ++, cmd, msg);
+}
+
+static void ipmsg_brocast_x(ipmsg_data *sd, unsigned long cmd, const char *msg)
+{
+	struct sockaddr_in sa;
+	memset(&sa, '\0', sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = inet_addr("255.255.255.255");
+	gaim_debug_info("ipmsg", "test %d\n", sd->user.port);
+	sa.sin_port = htons(sd->user.port);
+	ipmsg_send_msg(sd, &sa, cmd, msg);
+}
+
+static void ipmsg_brocast_online(ipmsg_data *sd)
+{
+	gaim_debug_info("ipmsg", "online\n");
+	ipmsg_brocast_x(sd, IPMSG_BR_ENTRY | sd->caps, sd->user.name);
+}
+
+static void ipmsg_brocast_offline(ipmsg_data *sd)
+{
+	gaim_debug_info("ipmsg", "offline\n");
+	ipmsg_brocast_x(sd, IPMSG_BR_EXIT, "");
+}
+
+/* {{{ packet parser */
+/* splits "ver:packetno:user:host:cmd:extra" in place */
+static gboolean ipmsg_packet_parse(ipmsg_packet *pkt, char *buf, size_t len)
+{
+	char *fields[5];
+	char *p = buf;
+	char *end = buf + len;
+	char *colon;
+	int i;
+
+	for (i = 0; i < 5; i ++) {
+		colon = memchr(p, ':', end - p);
+		if (colon == NULL) {
+			return FALSE;
+		}
+		*colon = '\0';
+		fields[i] = p;
+		p = colon + 1;
+	}
+
+	pkt->version  = strtoul(fields[0], NULL, 10);
+	pkt->packetno = strtoul(fields[1], NULL, 10);
+	pkt->user     = fields[2];
+	pkt->host     = fields[3];
+	pkt->cmd      = strtoul(fields[4], NULL, 10);
+	pkt->extra    = p;
+	pkt->extra_len = end - p;
+	return pkt->version == IPMSG_VERSION;
+}
+/* }}} */
+
+/* {{{ peer table */
+static guint ipmsg_addr_hash(gconstpointer key)
+{
+	const struct sockaddr_in *sa = key;
+	return sa->sin_addr.s_addr ^ ((guint) sa->sin_port << 16);
+}
+
+static gboolean ipmsg_addr_equal(gconstpointer a, gconstpointer b)
+{
+	const struct sockaddr_in *sa = a, *sb = b;
+	return sa->sin_addr.s_addr == sb->sin_addr.s_addr && sa->sin_port == sb->sin_port;
+}
+
+static void ipmsg_peer_free(ipmsg_data *sd, ipmsg_peer *peer)
+{
+	ipmsg_timer_del(&peer->live);
+	ipmsg_timer_del(&peer->info_wait);
+	g_free(peer->version.text);
+	g_free(peer->absence.text);
+	g_free(peer->search);
+	ipmsg_intern_unref(sd->names, peer->user.name);
+	ipmsg_intern_unref(sd->names, peer->user.host);
+	ipmsg_intern_unref(sd->names, peer->uid);
+	g_free(peer);
+}
+
+static void ipmsg_peer_free_one(gpointer key, gpointer value, gpointer data)
+{
+	ipmsg_peer_free(data, value);
+}
+
+static ipmsg_peer *ipmsg_peer_lookup(ipmsg_data *sd, const struct sockaddr_in *sa)
+{
+	return g_hash_table_lookup(sd->peers, sa);
+}
+
+static void ipmsg_liveness_check(ipmsg_data *sd, ipmsg_timer *t);
+
+/* the receive buffer has to hold what the whole LAN sends while the UI is
+ * busy; grown in powers of two as peers show up, never shrunk */
+static void ipmsg_rcvbuf_adjust(ipmsg_data *sd)
+{
+	int want = CLAMP(g_hash_table_size(sd->peers) * IPMSG_RCVBUF_PER_PEER, IPMSG_RCVBUF_MIN, IPMSG_RCVBUF_MAX);
+	int size = IPMSG_RCVBUF_MIN;
+	socklen_t len = sizeof(sd->rcvbuf);
+
+	if (want <= sd->rcvbuf_asked) {
+		return;
+	}
+	while (size < want) {
+		size *= 2;
+	}
+	sd->rcvbuf_asked = size;
+	if (setsockopt(sd->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0) {
+		gaim_debug_warning("ipmsg", "SO_RCVBUF: %s\n", strerror(errno));
+	}
+	/* Linux reports twice the request, capped by net.core.rmem_max */
+	if (getsockopt(sd->fd, SOL_SOCKET, SO_RCVBUF, &sd->rcvbuf, &len) == 0 && sd->rcvbuf < size) {
+		gaim_debug_info("ipmsg", "SO_RCVBUF capped at %d, asked for %d\n", sd->rcvbuf, size);
+	}
+}
+
+static gboolean ipmsg_peer_same_uid(gpointer key, gpointer value, gpointer data)
+{
+	ipmsg_peer *other = value;
+	ipmsg_peer *peer = data;
+
+	return other != peer && other->uid == peer->uid;
+}
+
+/* peers are keyed by address but peers_by_uid by user@host, and the same
+ * uid can answer from two addresses; TRUE if peer was the last to hold it */
+static gboolean ipmsg_peer_unindex(ipmsg_data *sd, ipmsg_peer *peer)
+{
+	ipmsg_peer *owner = g_hash_table_lookup(sd->peers_by_uid, peer->uid);
+
+	if (owner != NULL && owner != peer) {
+		return FALSE;
+	}
+	if ((owner = g_hash_table_find(sd->peers, ipmsg_peer_same_uid, peer)) != NULL) {
+		g_hash_table_replace(sd->peers_by_uid, (char *) owner->uid, owner);
+		return FALSE;
+	}
+	g_hash_table_remove(sd->peers_by_uid, peer->uid);
+	return TRUE;
+}
+
+static ipmsg_peer *ipmsg_peer_seen(ipmsg_data *sd, const struct sockaddr_in *sa, const ipmsg_packet *pkt)
+{
+	ipmsg_peer *peer = ipmsg_peer_lookup(sd, sa);
+
+	if (peer == NULL) {
+		peer = g_new0(ipmsg_peer, 1);
+		peer->addr = *sa;
+		peer->user.port = ntohs(sa->sin_port);
+		peer->live.func = ipmsg_liveness_check;
+		g_hash_table_insert(sd->peers, &peer->addr, peer);
+		ipmsg_rcvbuf_adjust(sd);
+		sd->live.churn_events ++;
+		/* spread first checks so a burst of ANSENTRY does not probe in lockstep */
+		ipmsg_timer_add(sd, &peer->live, sd->live.interval + g_random_int_range(0, sd->live.interval / 4 + 1));
+	}
+	else if (peer->user.name == ipmsg_intern_peek(sd->names, pkt->user) &&
+	         peer->user.host == ipmsg_intern_peek(sd->names, pkt->host)) {
+		peer->last_seen = sd->wheel.now;
+		peer->probes = 0;
+		return peer;
+	}
+	else {
+		/* renamed: the old buddy would otherwise stay online next to the new one */
+		if (ipmsg_peer_unindex(sd, peer)) {
+			gaim_prpl_got_user_status(sd->account, peer->uid, IPMSG_STATUS_OFFLINE, NULL);
+			if (sd->virtual_roster) {
+				ipmsg_blist_drop(sd, peer->uid);
+			}
+		}
+		ipmsg_intern_unref(sd->names, peer->user.name);
+		ipmsg_intern_unref(sd->names, peer->user.host);
+		ipmsg_intern_unref(sd->names, peer->uid);
+		g_free(peer->search);
+	}
+
+	peer->user.name = ipmsg_intern(sd->names, pkt->user);
+	peer->user.host = ipmsg_intern(sd->names, pkt->host);
+	{
+		ipmsg_uniqid uid;
+		ipmsg_uniqid_from_user(uid, &peer->user);
+		peer->uid = ipmsg_intern(sd->names, uid);
+	}
+	{
+		char *key = g_strdup_printf("%s %s %s", pkt->user, pkt->host, inet_ntoa(sa->sin_addr));
+		peer->search = g_utf8_casefold(key, -1);
+		g_free(key);
+	}
+	g_hash_table_replace(sd->peers_by_uid, (char *) peer->uid, peer);
+	peer->last_seen = sd->wheel.now;
+	peer->probes = 0;
+	return peer;
+}
+
+static void ipmsg_peer_gone(ipmsg_data *sd, ipmsg_peer *peer)
+{
+	if (ipmsg_peer_unindex(sd, peer)) {
+		gaim_prpl_got_user_status(sd->account, peer->uid, IPMSG_STATUS_OFFLINE, NULL);
+		if (sd->virtual_roster) {
+			ipmsg_blist_drop(sd, peer->uid);
+		}
+	}
+	sd->live.churn_events ++;
+	g_hash_table_remove(sd->peers, &peer->addr);
+	ipmsg_peer_free(sd, peer);
+}
+/* }}} */
+
+/* {{{ liveness sweep
+ * Peers that die without IPMSG_BR_EXIT are found by unicast probing the ones
+ * we have not heard from for a while. Every peer sits on the timer wheel once;
+ * hearing from a peer only touches last_seen and the wheel entry re-arms itself
+ * lazily when it fires. Probes draw from a per-tick token budget and are
+ * spread with jitter, so the sweep never bursts however large the roster.
+ */
+static void ipmsg_liveness_adapt(ipmsg_data *sd)
+{
+	guint n = g_hash_table_size(sd->peers);
+	double interval;
+	double floor;
+
+	/* a quiet network may be checked every n / TARGET_RATE seconds... */
+	interval = (double) n / IPMSG_LIVE_TARGET_RATE;
+	/* ...a churning one more often, as long as we stay under MAX_RATE */
+	interval /= 1.0 + sd->live.churn / IPMSG_LIVE_CHURN_SCALE;
+	floor = (double) n / IPMSG_LIVE_MAX_RATE;
+
+	interval = MAX(interval, floor);
+	sd->live.interval = CLAMP((unsigned int) interval, IPMSG_LIVE_MIN_INTERVAL, IPMSG_LIVE_MAX_INTERVAL);
+}
+
+static void ipmsg_liveness_churn(ipmsg_data *sd, ipmsg_timer *t)
+{
+	double sample = (double) sd->live.churn_events * 60 / IPMSG_LIVE_CHURN_PERIOD;
+
+	sd->live.churn = sd->live.churn * 0.75 + sample * 0.25;
+	sd->live.churn_events = 0;
+	ipmsg_liveness_adapt(sd);
+	ipmsg_timer_add(sd, t, IPMSG_LIVE_CHURN_PERIOD);
+}
+
+static gboolean ipmsg_liveness_take_token(ipmsg_data *sd)
+{
+	unsigned long elapsed = sd->wheel.now - sd->live.refilled;
+
+	if (elapsed > 0) {
+		sd->live.tokens = MIN(sd->live.tokens + elapsed * IPMSG_LIVE_MAX_RATE, IPMSG_LIVE_MAX_RATE);
+		sd->live.refilled = sd->wheel.now;
+	}
+	if (sd->live.tokens == 0) {
+		return FALSE;
+	}
+	sd->live.tokens --;
+	return TRUE;
+}
+
+static void ipmsg_liveness_check(ipmsg_data *sd, ipmsg_timer *t)
+{
+	ipmsg_peer *peer = IPMSG_TIMER_ENTRY(t, ipmsg_peer, live);
+	unsigned long quiet = sd->wheel.now - peer->last_seen;
+
+	if (sd->virtual_roster && peer->last_chat != 0 && sd->wheel.now - peer->last_chat >= IPMSG_ROSTER_RECENT) {
+		/* no longer recent: back to the LAN directory unless pinned */
+		peer->last_chat = 0;
+		ipmsg_blist_drop(sd, peer->uid);
+	}
+
+	if (peer->probes == 0 && quiet < sd->live.interval) {
+		ipmsg_timer_add(sd, t, sd->live.interval - quiet);
+		return;
+	}
+
+	if (peer->probes >= IPMSG_LIVE_MAX_PROBES) {
+		gaim_debug_info("ipmsg", "peer %s timed out\n", peer->uid);
+		sd->stats.peers_expired ++;
+		ipmsg_peer_gone(sd, peer);
+		return;
+	}
+
+	if (!ipmsg_liveness_take_token(sd)) {
+		sd->stats.probes_deferred ++;
+		ipmsg_timer_add(sd, t, 1 + g_random_int_range(0, IPMSG_LIVE_PROBE_TIMEOUT));
+		return;
+	}
+
+	peer->probes ++;
+	sd->stats.probes_sent ++;
+	/* the answer also refreshes the info cache */
+	peer->version.asked = sd->wheel.now;
+	ipmsg_send_msg(sd, &peer->addr, IPMSG_GETINFO, "");
+	ipmsg_timer_add(sd, t, IPMSG_LIVE_PROBE_TIMEOUT * peer->probes);
+}
+
+static void ipmsg_liveness_init(ipmsg_data *sd)
+{
+	sd->live.tokens = IPMSG_LIVE_MAX_RATE;
+	sd->live.refilled = sd->wheel.now;
+	sd->live.churn = 0;
+	sd->live.churn_events = 0;
+	sd->live.interval = IPMSG_LIVE_MIN_INTERVAL;
+	sd->live.churn_timer.func = ipmsg_liveness_churn;
+	ipmsg_timer_add(sd, &sd->live.churn_timer, IPMSG_LIVE_CHURN_PERIOD);
+}
+/* }}} */
+
+/* {{{ rediscovery
+ * After a network change, and at login when a recent peer list was saved,
+ * known peers get a unicast BR_ENTRY in paced batches first, so most of the
+ * roster is back without a broadcast. Only a poorly answered run (we moved
+ * to another network, most likely) broadcasts at once. A well-answered one
+ * leaves the broadcast for IPMSG_REDISCOVER_LATE seconds later: peers that
+ * joined since the last session then show up within minutes, or as soon as
+ * they broadcast themselves, which is the price of not waking every host on
+ * the segment on each network change.
+ */
+static char *ipmsg_rediscover_filename(ipmsg_data *sd)
+{
+	char *basename = g_strdup_printf("ipmsg-peers-%s", gaim_escape_filename(gaim_account_get_username(sd->account)));
+	char *filename = g_build_filename(gaim_user_dir(), basename, NULL);
+
+	g_free(basename);
+	return filename;
+}
+
+static void ipmsg_rediscover_add(ipmsg_data *sd, const struct sockaddr_in *sa)
+{
+	if (g_hash_table_lookup_extended(sd->rediscover.probed, sa, NULL, NULL)) {
+		return;
+	}
+	g_array_append_val(sd->rediscover.targets, *sa);
+	g_hash_table_insert(sd->rediscover.probed, g_memdup(sa, sizeof(*sa)), GINT_TO_POINTER(FALSE));
+}
+
+static void ipmsg_rediscover_add_peer(gpointer key, gpointer value, gpointer data)
+{
+	ipmsg_rediscover_add(data, key);
+}
+
+static void ipmsg_rediscover_late(ipmsg_data *sd, ipmsg_timer *t)
+{
+	gaim_debug_info("ipmsg", "rediscovery: deferred broadcast\n");
+	ipmsg_brocast_online(sd);
+}
+
+static void ipmsg_rediscover_end(ipmsg_data *sd)
+{
+	ipmsg_timer_del(&sd->rediscover.timer);
+	if (sd->rediscover.targets != NULL) {
+		g_array_free(sd->rediscover.targets, TRUE);
+		g_hash_table_destroy(sd->rediscover.probed);
+		sd->rediscover.targets = NULL;
+		sd->rediscover.probed = NULL;
+	}
+}
+
+static void ipmsg_rediscover_step(ipmsg_data *sd, ipmsg_timer *t)
+{
+	ipmsg_rediscovery *rd = &sd->rediscover;
+	guint n;
+
+	if (rd->waiting) {
+		double rate = (double) rd->answered / rd->targets->len;
+
+		gaim_debug_info("ipmsg", "rediscovery: %u of %u peers answered\n", rd->answered, rd->targets->len);
+		ipmsg_rediscover_end(sd);
+		if (rate < IPMSG_REDISCOVER_MIN_RATE) {
+			/* moved to another network, most likely */
+			sd->stats.rediscover.fallbacks ++;
+			ipmsg_timer_del(&rd->late);
+			ipmsg_brocast_online(sd);
+		}
+		else if (rd->late.next == NULL) {
+			/* an earlier run's pending broadcast covers this one too */
+			sd->stats.rediscover.deferred ++;
+			rd->late.func = ipmsg_rediscover_late;
+			ipmsg_timer_add(sd, &rd->late, IPMSG_REDISCOVER_LATE);
+		}
+		return;
+	}
+
+	for (n = 0; n < IPMSG_REDISCOVER_BATCH && rd->next < rd->targets->len; n ++, rd->next ++) {
+		ipmsg_send_msg(sd, &g_array_index(rd->targets, struct sockaddr_in, rd->next),
+		               IPMSG_BR_ENTRY | sd->caps, sd->user.name);
+		sd->stats.rediscover.probes ++;
+	}
+	if (rd->next == rd->targets->len) {
+		rd->waiting = TRUE;
+		ipmsg_timer_add(sd, t, IPMSG_REDISCOVER_WAIT);
+	}
+	else {
+		ipmsg_timer_add(sd, t, 1);
+	}
+}
+
+/* peers from the table, plus those saved by the last session if it is recent */
+static void ipmsg_rediscover(ipmsg_data *sd, gboolean use_saved)
+{
+	ipmsg_rediscovery *rd = &sd->rediscover;
+	char *filename;
+	struct stat st;
+	FILE *fp;
+
+	if (rd->targets != NULL) {
+		/* one run at a time, it probes the same peers anyway */
+		return;
+	}
+	rd->targets = g_array_new(FALSE, FALSE, sizeof(struct sockaddr_in));
+	rd->probed = g_hash_table_new_full(ipmsg_addr_hash, ipmsg_addr_equal, g_free, NULL);
+	rd->next = 0;
+	rd->answered = 0;
+	rd->waiting = FALSE;
+
+	g_hash_table_foreach(sd->peers, ipmsg_rediscover_add_peer, sd);
+
+	filename = ipmsg_rediscover_filename(sd);
+	if (use_saved && stat(filename, &st) == 0 && time(NULL) - st.st_mtime < IPMSG_REDISCOVER_SAVED_TTL &&
+	    (fp = fopen(filename, "r")) != NULL) {
+		struct sockaddr_in sa;
+		char addr[16];
+		int port;
+
+		memset(&sa, '\0', sizeof(sa));
+		sa.sin_family = AF_INET;
+		while (rd->targets->len < IPMSG_REDISCOVER_MAX_SAVED && fscanf(fp, "%15s %d", addr, &port) == 2) {
+			if (inet_aton(addr, &sa.sin_addr) && port > 0 && port < 65536) {
+				sa.sin_port = htons(port);
+				ipmsg_rediscover_add(sd, &sa);
+			}
+		}
+		fclose(fp);
+	}
+	g_free(filename);
+
+	if (rd->targets->len == 0) {
+		ipmsg_rediscover_end(sd);
+		ipmsg_timer_del(&rd->late);
+		ipmsg_brocast_online(sd);
+		return;
+	}
+	gaim_debug_info("ipmsg", "rediscovery: probing %u known peers\n", rd->targets->len);
+	sd->stats.rediscover.runs ++;
+	rd->timer.func = ipmsg_rediscover_step;
+	ipmsg_timer_add(sd, &rd->timer, 0);
+}
+
+/* BR_ENTRY, ANSENTRY or BR_ABSENCE from sa */
+static void ipmsg_rediscover_answer(ipmsg_data *sd, const struct sockaddr_in *sa)
+{
+	ipmsg_rediscovery *rd = &sd->rediscover;
+	gpointer key, answered;
+
+	if (rd->targets != NULL && g_hash_table_lookup_extended(rd->probed, sa, &key, &answered) && !answered) {
+		g_hash_table_insert(rd->probed, key, GINT_TO_POINTER(TRUE));
+		rd->answered ++;
+		sd->stats.rediscover.answers ++;
+	}
+}
+
+typedef struct {
+	FILE *fp;
+	guint count;
+} ipmsg_rediscover_save_ctx;
+
+static void ipmsg_rediscover_save_one(gpointer key, gpointer value, gpointer data)
+{
+	ipmsg_rediscover_save_ctx *ctx = data;
+	ipmsg_peer *peer = value;
+
+	if (ctx->count ++ < IPMSG_REDISCOVER_MAX_SAVED) {
+		fprintf(ctx->fp, "%s %d\n", inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port));
+	}
+}
+
+static void ipmsg_rediscover_save(ipmsg_data *sd)
+{
+	ipmsg_rediscover_save_ctx ctx;
+	char *filename;
+
+	if (sd->peers == NULL || g_hash_table_size(sd->peers) == 0) {
+		return;
+	}
+	filename = ipmsg_rediscover_filename(sd);
+	if ((ctx.fp = fopen(filename, "w")) != NULL) {
+		ctx.count = 0;
+		g_hash_table_foreach(sd->peers, ipmsg_rediscover_save_one, &ctx);
+		fclose(ctx.fp);
+	}
+	else {
+		gaim_debug_warning("ipmsg", "%s: %s\n", filename, strerror(errno));
+	}
+	g_free(filename);
+}
+
+static void ipmsg_network_changed(ipmsg_data *sd)
+{
+	gaim_debug_info("ipmsg", "network configuration changed\n");
+	ipmsg_rediscover(sd, FALSE);
+}
+/* }}} */
+
+/* {{{ acknowledgements and duplicates */
+static void ipmsg_pending_ack_free(gpointer data)
+{
+	ipmsg_pending_ack *pa = data;
+
+	ipmsg_timer_del(&pa->timeout);
+	g_free(pa->msg);
+	g_free(pa->who);
+	g_free(pa);
+}
+
+/* like IPMsg clients, resend the same packet number a few times, the
+ * receiver's duplicate check drops the copies it already has */
+static void ipmsg_pending_ack_expire(ipmsg_data *sd, ipmsg_timer *t)
+{
+	ipmsg_pending_ack *pa = IPMSG_TIMER_ENTRY(t, ipmsg_pending_ack, timeout);
+	GaimConversation *conv;
+
+	if (pa->msg != NULL && pa->retries < IPMSG_ACK_RETRIES) {
+		pa->retries ++;
+		sd->latency.acks_resent ++;
+		/* the timer is armed again once the lane sends it */
+		ipmsg_send_packet(sd, &pa->to, pa->packetno, pa->cmd, pa->msg);
+		return;
+	}
+	sd->latency.acks_lost ++;
+	if (pa->who != NULL &&
+	    (conv = gaim_find_conversation_with_account(GAIM_CONV_TYPE_IM, pa->who, sd->account))) {
+		gaim_conversation_write(conv, NULL, _("A message was not acknowledged and may not have been delivered."),
+		                        GAIM_MESSAGE_ERROR, time(NULL));
+	}
+	g_hash_table_remove(sd->pending_acks, &pa->packetno);
+}
+
+static void ipmsg_pending_ack_add(ipmsg_data *sd, unsigned long packetno, const struct sockaddr_in *to,
+                                  const char *who, unsigned long cmd, const char *msg)
+{
+	ipmsg_pending_ack *pa = g_new0(ipmsg_pending_ack, 1);
+
+	pa->packetno = packetno;
+	pa->to = *to;
+	pa->cmd = cmd;
+	pa->msg = g_strdup(msg);
+	pa->who = g_strdup(who);
+	pa->timeout.func = ipmsg_pending_ack_expire;
+	g_hash_table_replace(sd->pending_acks, &pa->packetno, pa);
+}
+
+/* the timer starts when the lane lets the packet go, not when it is queued */
+static void ipmsg_pending_ack_sent(ipmsg_data *sd, const ipmsg_outpkt *op)
+{
+	ipmsg_pending_ack *pa = g_hash_table_lookup(sd->pending_acks, &op->packetno);
+
+	if (pa != NULL && pa->to.sin_addr.s_addr == op->addr.sin_addr.s_addr) {
+		clock_gettime(CLOCK_REALTIME, &pa->sent);
+		ipmsg_timer_add(sd, &pa->timeout, IPMSG_ACK_TIMEOUT);
+	}
+}
+
+static void ipmsg_pending_ack_done(ipmsg_data *sd, const struct sockaddr_in *sa, const ipmsg_packet *pkt)
+{
+	unsigned long packetno = strtoul(pkt->extra, NULL, 10);
+	ipmsg_pending_ack *pa = g_hash_table_lookup(sd->pending_acks, &packetno);
+
+	/* a colliding packet number from another host is not our ack */
+	if (pa != NULL && pa->to.sin_addr.s_addr == sa->sin_addr.s_addr && pa->to.sin_port == sa->sin_port) {
+		ipmsg_histogram_add(&sd->latency.ack, &pa->sent, &pkt->rx);
+		g_hash_table_remove(sd->pending_acks, &packetno);
+	}
+}
+
+static guint ipmsg_ulong_hash(gconstpointer key)
+{
+	return (guint) *(const unsigned long *) key;
+}
+
+static gboolean ipmsg_ulong_equal(gconstpointer a, gconstpointer b)
+{
+	return *(const unsigned long *) a == *(const unsigned long *) b;
+}
+
+/* senders, we included, retransmit SENDMSG until acknowledged; a direct
+ * mapped cache of recent (address, packetno) pairs is enough to catch those */
+static ipmsg_dedupe_slot *ipmsg_dedupe_slot_of(ipmsg_data *sd, const struct sockaddr_in *sa, const ipmsg_packet *pkt)
+{
+	guint h = (sa->sin_addr.s_addr * 2654435761U) ^ pkt->packetno;
+
+	return &sd->dedupe[h & (IPMSG_DEDUPE_SLOTS - 1)];
+}
+
+static gboolean ipmsg_is_duplicate(ipmsg_data *sd, const struct sockaddr_in *sa, const ipmsg_packet *pkt)
+{
+	ipmsg_dedupe_slot *slot = ipmsg_dedupe_slot_of(sd, sa, pkt);
+
+	return slot->addr == sa->sin_addr.s_addr && slot->packetno == pkt->packetno;
+}
+
+/* a peer announcing itself may have restarted and count its packet numbers
+ * from where it started last time, its old entries would drop new messages */
+static void ipmsg_dedupe_forget(ipmsg_data *sd, const struct sockaddr_in *sa)
+{
+	int i;
+
+	for (i = 0; i < IPMSG_DEDUPE_SLOTS; i ++) {
+		if (sd->dedupe[i].addr == sa->sin_addr.s_addr) {
+			sd->dedupe[i].addr = 0;
+			sd->dedupe[i].packetno = 0;
+		}
+	}
+}
+
+/* only once the message is really shown: a failed long message fetch must
+ * not make the next copy of it a duplicate */
+static void ipmsg_dedupe_claim(ipmsg_data *sd, const struct sockaddr_in *sa, const ipmsg_packet *pkt)
+{
+	ipmsg_dedupe_slot *slot = ipmsg_dedupe_slot_of(sd, sa, pkt);
+
+	slot->addr = sa->sin_addr.s_addr;
+	slot->packetno = pkt->packetno;
+}
+/* }}} */
+
+/* {{{ flood protection
+ * Every source address has a token bucket that is charged before the
+ * datagram is even parsed. A host that keeps overrunning its budget is muted
+ * for a while, its datagrams are then dropped after one hash lookup.
+ */
+static void ipmsg_flood_mute(ipmsg_data *sd, ipmsg_flood_bucket *b)
+{
+	struct in_addr in;
+
+	in.s_addr = b->addr;
+	gaim_debug_warning("ipmsg", "muting %s for %d seconds, flooding\n", inet_ntoa(in), IPMSG_FLOOD_MUTE);
+	b->muted_until = sd->wheel.now + IPMSG_FLOOD_MUTE;
+	sd->stats.flood.mutes ++;
+}
+
+static gboolean ipmsg_flood_admit(ipmsg_data *sd, const struct sockaddr_in *sa, const struct timespec *now)
+{
+	unsigned long addr = sa->sin_addr.s_addr;
+	ipmsg_flood_bucket *b = g_hash_table_lookup(sd->flood, &addr);
+	double elapsed;
+
+	if (b == NULL) {
+		b = g_new0(ipmsg_flood_bucket, 1);
+		b->addr = addr;
+		b->tokens = IPMSG_FLOOD_BURST;
+		b->refilled = *now;
+		g_hash_table_insert(sd->flood, &b->addr, b);
+	}
+	b->last_seen = sd->wheel.now;
+
+	if (b->muted_until != 0) {
+		if (sd->wheel.now < b->muted_until) {
+			sd->stats.flood.dropped ++;
+			return FALSE;
+		}
+		b->muted_until = 0;
+		b->strikes = 0;
+		b->tokens = IPMSG_FLOOD_BURST;
+		b->refilled = *now;
+	}
+
+	elapsed = (now->tv_sec - b->refilled.tv_sec) + (now->tv_nsec - b->refilled.tv_nsec) / 1e9;
+	if (elapsed > 0) {
+		b->tokens = MIN(b->tokens + elapsed * IPMSG_FLOOD_RATE, IPMSG_FLOOD_BURST);
+		b->refilled = *now;
+		if (b->tokens >= IPMSG_FLOOD_BURST) {
+			b->strikes = 0;
+		}
+	}
+
+	if (b->tokens >= 1) {
+		b->tokens -= 1;
+		return TRUE;
+	}
+	sd->stats.flood.dropped ++;
+	if (++ b->strikes >= IPMSG_FLOOD_STRIKES) {
+		ipmsg_flood_mute(sd, b);
+	}
+	return FALSE;
+}
+
+static gboolean ipmsg_flood_idle(gpointer key, gpointer value, gpointer data)
+{
+	ipmsg_data *sd = data;
+	ipmsg_flood_bucket *b = value;
+
+	return b->muted_until == 0 && sd->wheel.now - b->last_seen >= IPMSG_FLOOD_IDLE;
+}
+
+static void ipmsg_flood_sweep(ipmsg_data *sd, ipmsg_timer *t)
+{
+	g_hash_table_foreach_remove(sd->flood, ipmsg_flood_idle, sd);
+	ipmsg_timer_add(sd, t, IPMSG_FLOOD_IDLE);
+}
+
+static void ipmsg_flood_init(ipmsg_data *sd)
+{
+	sd->flood = g_hash_table_new_full(ipmsg_ulong_hash, ipmsg_ulong_equal, NULL, g_free);
+	sd->flood_sweep.func = ipmsg_flood_sweep;
+	ipmsg_timer_add(sd, &sd->flood_sweep, IPMSG_FLOOD_IDLE);
+}
+
+static void ipmsg_flood_free(ipmsg_data *sd)
+{
+	ipmsg_timer_del(&sd->flood_sweep);
+	if (sd->flood != NULL) {
+		g_hash_table_destroy(sd->flood);
+		sd->flood = NULL;
+	}
+}
+
+static void ipmsg_flood_append_muted(gpointer key, gpointer value, gpointer data)
+{
+	ipmsg_flood_bucket *b = value;
+	GString *str = data;
+	struct in_addr in;
+
+	if (b->muted_until != 0) {
+		in.s_addr = b->addr;
+		g_string_append_printf(str, " %s", inet_ntoa(in));
+	}
+}
+/* }}} */
+
+/* {{{ message text */
+/* legacy clients send the local code page, configured per account */
+static char *ipmsg_legacy_to_utf8(ipmsg_data *sd, const char *str, size_t len)
+{
+	const char *encoding = gaim_account_get_string(sd->account, "encoding", IPMSG_DEFAULT_ENCODING);
+	char *out = NULL;
+
+	if (g_ascii_strcasecmp(encoding, "UTF-8") != 0) {
+		out = g_convert_with_fallback(str, len, "UTF-8", encoding, "?", NULL, NULL, NULL);
+	}
+	if (out == NULL || !ipmsg_utf8_validate(out, strlen(out))) {
+		g_free(out);
+		out = ipmsg_utf8_make_valid(str, len);
+	}
+	return out;
+}
+
+static void ipmsg_show_im(GaimConnection *gc, ipmsg_data *sd, const char *who, const char *body, size_t len, time_t mtime)
+{
+	char *html;
+
+	/* nothing unvalidated may reach the markup code */
+	if (ipmsg_utf8_validate(body, len)) {
+		html = g_markup_escape_text(body, len);
+	}
+	else {
+		char *text = ipmsg_legacy_to_utf8(sd, body, len);
+		html = g_markup_escape_text(text, -1);
+		g_free(text);
+	}
+
+	serv_got_im(gc, who, html, 0, mtime);
+	g_free(html);
+}
+/* }}} */
+
+/* {{{ peer info cache
+ * Tooltips and get_info read SENDINFO/SENDABSENCEINFO answers from the peer
+ * record. A stale answer is still shown and refreshed behind the user's back;
+ * a query already out is shared by everyone who asks meanwhile.
+ */
+static gboolean ipmsg_info_fresh(ipmsg_data *sd, const ipmsg_info *info)
+{
+	return info->text != NULL && sd->wheel.now - info->fetched < IPMSG_INFO_TTL;
+}
+
+static void ipmsg_info_query(ipmsg_data *sd, ipmsg_peer *peer, ipmsg_info *info, unsigned long cmd)
+{
+	if (ipmsg_info_fresh(sd, info)) {
+		return;
+	}
+	if (info->asked != 0 && sd->wheel.now - info->asked < IPMSG_INFO_QUERY_TIMEOUT) {
+		sd->stats.info_shared ++;
+		return;
+	}
+	info->asked = MAX(sd->wheel.now, 1);
+	sd->stats.info_queries ++;
+	ipmsg_send_msg(sd, &peer->addr, cmd, "");
+}
+
+static void ipmsg_info_refresh(ipmsg_data *sd, ipmsg_peer *peer)
+{
+	ipmsg_info_query(sd, peer, &peer->version, IPMSG_GETINFO);
+	/* only absent peers have anything to say here */
+	if (peer->caps & IPMSG_ABSENCEOPT) {
+		ipmsg_info_query(sd, peer, &peer->absence, IPMSG_GETABSENCEINFO);
+	}
+}
+
+static void ipmsg_info_show(ipmsg_data *sd, ipmsg_peer *peer)
+{
+	GString *str = g_string_new(NULL);
+	char *esc;
+
+	ipmsg_timer_del(&peer->info_wait);
+
+	esc = g_markup_escape_text(peer->user.name, -1);
+	g_string_append_printf(str, "<b>%s</b> %s<br>", _("User:"), esc);
+	g_free(esc);
+	esc = g_markup_escape_text(peer->user.host, -1);
+	g_string_append_printf(str, "<b>%s</b> %s<br>", _("Host:"), esc);
+	g_free(esc);
+	g_string_append_printf(str, "<b>%s</b> %s:%d<br>", _("Address:"),
+	                       inet_ntoa(peer->addr.sin_addr), ntohs(peer->addr.sin_port));
+	if (peer->version.text != NULL) {
+		esc = g_markup_escape_text(peer->version.text, -1);
+		g_string_append_printf(str, "<b>%s</b> %s<br>", _("Version:"), esc);
+		g_free(esc);
+	}
+	if ((peer->caps & IPMSG_ABSENCEOPT) && peer->absence.text != NULL) {
+		esc = g_markup_escape_text(peer->absence.text, -1);
+		g_string_append_printf(str, "<b>%s</b> %s<br>", _("Away:"), esc);
+		g_free(esc);
+	}
+
+	gaim_notify_userinfo(gaim_account_get_connection(sd->account), peer->uid, str->str, NULL, NULL);
+	g_string_free(str, TRUE);
+}
+
+static void ipmsg_info_wait_done(ipmsg_data *sd, ipmsg_timer *t)
+{
+	ipmsg_info_show(sd, IPMSG_TIMER_ENTRY(t, ipmsg_peer, info_wait));
+}
+
+static void ipmsg_info_store(ipmsg_data *sd, ipmsg_peer *peer, ipmsg_info *info, const ipmsg_packet *pkt)
+{
+	size_t len = strlen(pkt->extra);
+
+	g_free(info->text);
+	if (ipmsg_utf8_validate(pkt->extra, len)) {
+		info->text = g_strndup(pkt->extra, len);
+	}
+	else {
+		info->text = ipmsg_legacy_to_utf8(sd, pkt->extra, len);
+	}
+	info->fetched = sd->wheel.now;
+	info->asked = 0;
+
+	/* someone is waiting for the first answer */
+	if (peer->info_wait.next != NULL && peer->version.asked == 0 && peer->absence.asked == 0) {
+		ipmsg_info_show(sd, peer);
+	}
+}
+
+static void ipmsg_get_info(GaimConnection *gc, const char *who)
+{
+	ipmsg_data *sd = gc->proto_data;
+	ipmsg_peer *peer = g_hash_table_lookup(sd->peers_by_uid, who);
+
+	if (peer == NULL) {
+		gaim_notify_error(gc, NULL, _("User information is not available"), _("The user is not online."));
+		return;
+	}
+
+	ipmsg_info_refresh(sd, peer);
+	if (peer->version.text != NULL) {
+		sd->stats.info_hits ++;
+		ipmsg_info_show(sd, peer);
+	}
+	else if (peer->info_wait.next == NULL) {
+		peer->info_wait.func = ipmsg_info_wait_done;
+		ipmsg_timer_add(sd, &peer->info_wait, IPMSG_INFO_QUERY_TIMEOUT);
+	}
+}
+
+static void ipmsg_tooltip_text(GaimBuddy *buddy, GString *str, gboolean full)
+{
+	GaimConnection *gc = gaim_account_get_connection(buddy->account);
+	ipmsg_data *sd;
+	ipmsg_peer *peer;
+	char *esc;
+
+	if (gc == NULL || (sd = gc->proto_data) == NULL) {
+		return;
+	}
+	if ((peer = g_hash_table_lookup(sd->peers_by_uid, buddy->name)) == NULL) {
+		return;
+	}
+
+	/* never wait on the network while hovering */
+	ipmsg_info_refresh(sd, peer);
+	if (peer->version.text != NULL) {
+		sd->stats.info_hits ++;
+	}
+
+	g_string_append_printf(str, "\n<b>%s</b> %s", _("Address:"), inet_ntoa(peer->addr.sin_addr));
+	if (full && peer->version.text != NULL) {
+		esc = g_markup_escape_text(peer->version.text, -1);
+		g_string_append_printf(str, "\n<b>%s</b> %s", _("Version:"), esc);
+		g_free(esc);
+	}
+	if ((peer->caps & IPMSG_ABSENCEOPT) && peer->absence.text != NULL) {
+		esc = g_markup_escape_text(peer->absence.text, -1);
+		g_string_append_printf(str, "\n<b>%s</b> %s", _("Away:"), esc);
+		g_free(esc);
+	}
+}
+/* }}} */
+
+/* {{{ sealed messages
+ * Both directions share one index keyed by (address, packet number,
+ * direction), so READMSG/DELMSG match in O(1). Entries are grouped into
+ * generations of IPMSG_SEAL_GEN_PERIOD; a generation holds a single wheel
+ * entry and goes as a whole when its TTL is up, or early when the index
+ * would grow past IPMSG_SEAL_MAX. An envelope that goes unopened that way
+ * counts as deleted: the sender gets DELMSG and the conversation a note.
+ */
+static guint ipmsg_seal_key_hash(gconstpointer key)
+{
+	const ipmsg_seal_key *k = key;
+	return (k->addr * 2654435761U) ^ k->packetno ^ (k->outgoing ? 0x80000000U : 0);
+}
+
+static gboolean ipmsg_seal_key_equal(gconstpointer a, gconstpointer b)
+{
+	const ipmsg_seal_key *ka = a, *kb = b;
+	return ka->addr == kb->addr && ka->packetno == kb->packetno && ka->outgoing == kb->outgoing;
+}
+
+/* unlinks and frees, the caller takes it out of the index */
+static void ipmsg_sealed_free(ipmsg_data *sd, ipmsg_sealed *e)
+{
+	ipmsg_seal_gen *gen = e->gen;
+
+	if (e->prev != NULL) {
+		e->prev->next = e->next;
+	}
+	else {
+		gen->first = e->next;
+	}
+	if (e->next != NULL) {
+		e->next->prev = e->prev;
+	}
+	gen->count --;
+	sd->sealed_count --;
+
+	if (e->request != NULL) {
+		gaim_request_close(GAIM_REQUEST_ACTION, e->request);
+	}
+	g_free(e->body);
+	g_free(e);
+}
+
+static void ipmsg_sealed_remove(ipmsg_data *sd, ipmsg_sealed *e)
+{
+	g_hash_table_remove(sd->sealed, &e->key);
+	ipmsg_sealed_free(sd, e);
+}
+
+/* an unopened envelope aged out or was pushed out, its dialog closes with it */
+static void ipmsg_sealed_expired(ipmsg_data *sd, ipmsg_sealed *e)
+{
+	GaimConversation *conv;
+	char ack[24];
+
+	if (e->key.outgoing || e->body == NULL) {
+		return;
+	}
+	g_snprintf(ack, sizeof(ack), "%lu", e->key.packetno);
+	ipmsg_send_msg(sd, &e->addr, IPMSG_DELMSG, ack);
+	if ((conv = gaim_find_conversation_with_account(GAIM_CONV_TYPE_IM, e->who, sd->account)) == NULL) {
+		conv = gaim_conversation_new(GAIM_CONV_TYPE_IM, sd->account, e->who);
+	}
+	gaim_conversation_write(conv, NULL, _("A sealed message expired unopened and was deleted."),
+	                        GAIM_MESSAGE_SYSTEM, time(NULL));
+}
+
+/* expired: evicted or timed out, as opposed to dropped at logout */
+static void ipmsg_seal_gen_free(ipmsg_data *sd, ipmsg_seal_gen *gen, gboolean expired)
+{
+	g_queue_remove(sd->seal_gens, gen);
+	ipmsg_timer_del(&gen->expire);
+	sd->stats.seal.expired += gen->count;
+	while (gen->first != NULL) {
+		if (expired) {
+			ipmsg_sealed_expired(sd, gen->first);
+		}
+		ipmsg_sealed_remove(sd, gen->first);
+	}
+	g_free(gen);
+}
+
+static void ipmsg_seal_gen_expire(ipmsg_data *sd, ipmsg_timer *t)
+{
+	ipmsg_seal_gen_free(sd, IPMSG_TIMER_ENTRY(t, ipmsg_seal_gen, expire), TRUE);
+}
+
+static ipmsg_sealed *ipmsg_sealed_add(ipmsg_data *sd, const struct sockaddr_in *sa, unsigned long packetno,
+                                      gboolean outgoing, const char *who)
+{
+	ipmsg_seal_gen *gen = g_queue_peek_tail(sd->seal_gens);
+	ipmsg_sealed *e;
+
+	while (sd->sealed_count >= IPMSG_SEAL_MAX) {
+		ipmsg_seal_gen_free(sd, g_queue_peek_head(sd->seal_gens), TRUE);
+		gen = g_queue_peek_tail(sd->seal_gens);
+	}
+	if (gen == NULL || sd->wheel.now - gen->opened >= IPMSG_SEAL_GEN_PERIOD) {
+		gen = g_new0(ipmsg_seal_gen, 1);
+		gen->opened = sd->wheel.now;
+		gen->expire.func = ipmsg_seal_gen_expire;
+		ipmsg_timer_add(sd, &gen->expire, IPMSG_SEAL_GEN_PERIOD + IPMSG_SEAL_TTL);
+		g_queue_push_tail(sd->seal_gens, gen);
+	}
+
+	e = g_new0(ipmsg_sealed, 1);
+	e->key.addr = sa->sin_addr.s_addr;
+	e->key.packetno = packetno;
+	e->key.outgoing = outgoing;
+	e->sd = sd;
+	e->addr = *sa;
+	g_strlcpy(e->who, who, sizeof(e->who));
+
+	e->gen = gen;
+	e->next = gen->first;
+	if (gen->first != NULL) {
+		gen->first->prev = e;
+	}
+	gen->first = e;
+	gen->count ++;
+	sd->sealed_count ++;
+
+	/* a retransmitted SENDMSG replaces the older entry */
+	{
+		ipmsg_sealed *old = g_hash_table_lookup(sd->sealed, &e->key);
+		if (old != NULL) {
+			ipmsg_sealed_remove(sd, old);
+		}
+	}
+	g_hash_table_insert(sd->sealed, &e->key, e);
+	return e;
+}
+
+static void ipmsg_sealed_open_cb(ipmsg_sealed *e, int action)
+{
+	ipmsg_data *sd = e->sd;
+	char ack[24];
+
+	/* the dialog is gone by now */
+	e->request = NULL;
+	g_snprintf(ack, sizeof(ack), "%lu", e->key.packetno);
+
+	if (action == 0) {
+		ipmsg_show_im(gaim_account_get_connection(sd->account), sd, e->who, e->body, e->len, e->mtime);
+		ipmsg_send_msg(sd, &e->addr, IPMSG_READMSG, ack);
+		sd->stats.seal.opened ++;
+	}
+	else {
+		ipmsg_send_msg(sd, &e->addr, IPMSG_DELMSG, ack);
+		sd->stats.seal.deleted ++;
+	}
+	ipmsg_sealed_remove(sd, e);
+}
+
+static void ipmsg_sealed_got(ipmsg_data *sd, const struct sockaddr_in *sa, const char *who,
+                             const ipmsg_packet *pkt, const char *body, size_t len)
+{
+	ipmsg_sealed *e = ipmsg_sealed_add(sd, sa, pkt->packetno, FALSE, who);
+	char *primary;
+
+	e->body = g_memdup(body, len + 1);
+	e->len = len;
+	e->mtime = pkt->rx.tv_sec;
+	sd->stats.seal.sealed_in ++;
+
+	primary = g_strdup_printf(_("Sealed message from %s"), who);
+	e->request = gaim_request_action(gaim_account_get_connection(sd->account), _("IPMsg"), primary,
+	                                 _("The sender is told when you open or delete it."),
+	                                 0, e, 2,
+	                                 _("Open"), G_CALLBACK(ipmsg_sealed_open_cb),
+	                                 _("Delete"), G_CALLBACK(ipmsg_sealed_open_cb));
+	g_free(primary);
+}
+
+static ipmsg_sealed *ipmsg_sealed_sent(ipmsg_data *sd, const ipmsg_peer *peer, unsigned long packetno)
+{
+	sd->stats.seal.sealed_out ++;
+	return ipmsg_sealed_add(sd, &peer->addr, packetno, TRUE, peer->uid);
+}
+
+/* READMSG or DELMSG for one of ours */
+static void ipmsg_sealed_receipt(ipmsg_data *sd, const struct sockaddr_in *sa, const ipmsg_packet *pkt)
+{
+	ipmsg_seal_key key;
+	ipmsg_sealed *e;
+	GaimConversation *conv;
+	gboolean read = IPMSG_GET_MODE(pkt->cmd) == IPMSG_READMSG;
+
+	key.addr = sa->sin_addr.s_addr;
+	key.packetno = strtoul(pkt->extra, NULL, 10);
+	key.outgoing = TRUE;
+	if ((e = g_hash_table_lookup(sd->sealed, &key)) == NULL) {
+		return;
+	}
+
+	if ((conv = gaim_find_conversation_with_account(GAIM_CONV_TYPE_IM, e->who, sd->account))) {
+		gaim_conversation_write(conv, NULL,
+		                        read ? _("Your sealed message was opened.") : _("Your sealed message was deleted unopened."),
+		                        GAIM_MESSAGE_SYSTEM, pkt->rx.tv_sec);
+	}
+	if (read) {
+		sd->stats.seal.opened ++;
+	}
+	else {
+		sd->stats.seal.deleted ++;
+	}
+	ipmsg_sealed_remove(sd, e);
+}
+
+static void ipmsg_sealed_init(ipmsg_data *sd)
+{
+	sd->sealed = g_hash_table_new(ipmsg_seal_key_hash, ipmsg_seal_key_equal);
+	sd->seal_gens = g_queue_new();
+	sd->sealed_count = 0;
+}
+
+static void ipmsg_sealed_shutdown(ipmsg_data *sd)
+{
+	ipmsg_seal_gen *gen;
+
+	if (sd->seal_gens == NULL) {
+		return;
+	}
+	while ((gen = g_queue_peek_head(sd->seal_gens)) != NULL) {
+		ipmsg_seal_gen_free(sd, gen, FALSE);
+	}
+	g_queue_free(sd->seal_gens);
+	sd->seal_gens = NULL;
+	g_hash_table_destroy(sd->sealed);
+	sd->sealed = NULL;
+}
+/* }}} */
+
+/* {{{ message delivery */
+static void ipmsg_deliver_im(GaimConnection *gc, ipmsg_data *sd, const struct sockaddr_in *sa, const char *who,
+                             const ipmsg_packet *pkt, const char *body, size_t len, const struct timespec *deduped)
+{
+	struct timespec delivered;
+
+	ipmsg_blist_chatting(sd, who);
+	if (pkt->cmd & IPMSG_SECRETOPT) {
+		/* shown once the user breaks the seal */
+		ipmsg_sealed_got(sd, sa, who, pkt, body, len);
+		return;
+	}
+	ipmsg_show_im(gc, sd, who, body, len, pkt->rx.tv_sec);
+
+	clock_gettime(CLOCK_REALTIME, &delivered);
+	ipmsg_histogram_add(&sd->latency.dedupe, &pkt->dequeued, deduped);
+	ipmsg_histogram_add(&sd->latency.deliver, deduped, &delivered);
+	ipmsg_histogram_add(&sd->latency.total, &pkt->rx, &delivered);
+}
+
+static void ipmsg_got_im(GaimConnection *gc, ipmsg_data *sd, ipmsg_peer *peer, const ipmsg_packet *pkt)
+{
+	struct timespec deduped;
+
+	if (ipmsg_is_duplicate(sd, &peer->addr, pkt)) {
+		sd->latency.duplicates ++;
+		return;
+	}
+	ipmsg_dedupe_claim(sd, &peer->addr, pkt);
+	clock_gettime(CLOCK_REALTIME, &deduped);
+	ipmsg_deliver_im(gc, sd, &peer->addr, peer->uid, pkt, pkt->extra, strlen(pkt->extra), &deduped);
+}
+/* }}} */
+
+/* {{{ long messages over TCP
+ * A body above IPMSG_LONGMSG_THRESHOLD would be IP fragmented, and losing any
+ * fragment loses the whole message. On the wire, beyond plain IPMsg:
+ *  - our SENDINFO answer ends in IPMSG_LONGMSG_TAG and the port of a TCP
+ *    listener bound to an ephemeral port, never the IPMsg port, which real
+ *    clients use for file transfer;
+ *  - to a peer that answered so, a long body goes as a SENDMSG with
+ *    IPMSG_LONGMSGOPT whose extra is "<length>:<port>" instead of the text;
+ *  - the peer connects to the port from our own SENDINFO, never to the one
+ *    in the descriptor, sends the packet number and a newline, and reads the
+ *    body. The usual RECVMSG follows once the body is in, and releases it.
+ * Other clients never answer with the tag, so they never see the bit; a
+ * SENDMSG whose extra doesn't parse is taken as an ordinary message. A
+ * descriptor from a peer that hasn't advertised the tag to us is dropped,
+ * we only ever connect where a SENDINFO told us to; answering its GETINFO
+ * asks for its SENDINFO in turn, so both ends learn the other's port.
+ */
+static void ipmsg_stream_close(ipmsg_stream *st)
+{
+	ipmsg_data *sd = st->sd;
+
+	if (st->inpa) {
+		gaim_input_remove(st->inpa);
+	}
+	close(st->fd);
+	ipmsg_timer_del(&st->timeout);
+	sd->streams = g_list_remove(sd->streams, st);
+	if (st->serving) {
+		sd->serving --;
+	}
+	else {
+		sd->fetching --;
+	}
+	g_free(st->body);
+	g_free(st);
+}
+
+static void ipmsg_stream_watch(ipmsg_stream *st, GaimInputCondition cond, GaimInputFunction func)
+{
+	if (st->inpa) {
+		gaim_input_remove(st->inpa);
+	}
+	st->inpa = gaim_input_add(st->fd, cond, func, st);
+}
+
+static void ipmsg_stream_fail(ipmsg_stream *st, const char *why)
+{
+	ipmsg_data *sd = st->sd;
+	GaimConversation *conv;
+
+	gaim_debug_warning("ipmsg", "long message stream %s: %s\n",
+	                   inet_ntoa(st->addr.sin_addr), why);
+	if (!st->serving) {
+		sd->stats.longmsg.longmsg_failed ++;
+		if ((conv = gaim_find_conversation_with_account(GAIM_CONV_TYPE_IM, st->who, sd->account))) {
+			gaim_conversation_write(conv, NULL, _("A long message could not be retrieved."),
+			                        GAIM_MESSAGE_ERROR, time(NULL));
+		}
+	}
+	ipmsg_stream_close(st);
+}
+
+static void ipmsg_stream_timeout(ipmsg_data *sd, ipmsg_timer *t)
+{
+	ipmsg_stream_fail(IPMSG_TIMER_ENTRY(t, ipmsg_stream, timeout), "timed out");
+}
+
+static ipmsg_stream *ipmsg_stream_new(ipmsg_data *sd, int fd, const struct sockaddr_in *sa, gboolean serving)
+{
+	ipmsg_stream *st = g_new0(ipmsg_stream, 1);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	st->sd = sd;
+	st->fd = fd;
+	st->addr = *sa;
+	st->serving = serving;
+	st->timeout.func = ipmsg_stream_timeout;
+	ipmsg_timer_add(sd, &st->timeout, IPMSG_LONGMSG_TIMEOUT);
+	sd->streams = g_list_prepend(sd->streams, st);
+	if (serving) {
+		sd->serving ++;
+	}
+	else {
+		sd->fetching ++;
+	}
+	return st;
+}
+
+/* sending side */
+static void ipmsg_longmsg_free(gpointer data)
+{
+	ipmsg_longmsg *lm = data;
+
+	ipmsg_timer_del(&lm->expire);
+	g_free(lm->body);
+	g_free(lm);
+}
+
+static void ipmsg_longmsg_done(ipmsg_data *sd, unsigned long packetno)
+{
+	ipmsg_longmsg *lm = g_hash_table_lookup(sd->longmsgs, &packetno);
+	GList *l, *next;
+
+	if (lm == NULL) {
+		return;
+	}
+	for (l = sd->streams; l != NULL; l = next) {
+		ipmsg_stream *st = l->data;
+		next = l->next;
+		if (st->msg == lm) {
+			ipmsg_stream_close(st);
+		}
+	}
+	g_hash_table_remove(sd->longmsgs, &packetno);
+}
+
+/* RECVMSG from sa; another host's colliding packet number releases nothing */
+static void ipmsg_longmsg_received(ipmsg_data *sd, const struct sockaddr_in *sa, unsigned long packetno)
+{
+	ipmsg_longmsg *lm = g_hash_table_lookup(sd->longmsgs, &packetno);
+
+	if (lm != NULL && lm->addr.sin_addr.s_addr == sa->sin_addr.s_addr) {
+		ipmsg_longmsg_done(sd, packetno);
+	}
+}
+
+static void ipmsg_longmsg_expire(ipmsg_data *sd, ipmsg_timer *t)
+{
+	ipmsg_longmsg_done(sd, IPMSG_TIMER_ENTRY(t, ipmsg_longmsg, expire)->packetno);
+}
+
+/* takes body */
+static void ipmsg_longmsg_add(ipmsg_data *sd, unsigned long packetno, const struct sockaddr_in *sa, char *body)
+{
+	ipmsg_longmsg *lm = g_new0(ipmsg_longmsg, 1);
+
+	lm->packetno = packetno;
+	lm->addr = *sa;
+	lm->body = body;
+	lm->len = strlen(body);
+	lm->expire.func = ipmsg_longmsg_expire;
+	g_hash_table_replace(sd->longmsgs, &lm->packetno, lm);
+	ipmsg_timer_add(sd, &lm->expire, IPMSG_LONGMSG_KEEP);
+	sd->stats.longmsg.longmsg_sent ++;
+}
+
+static void ipmsg_stream_serve_write(gpointer data, gint source, GaimInputCondition cond)
+{
+	ipmsg_stream *st = data;
+	ssize_t n;
+
+	n = write(st->fd, st->msg->body + st->done, st->msg->len - st->done);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			ipmsg_stream_fail(st, strerror(errno));
+		}
+		return;
+	}
+	st->done += n;
+	if (st->done == st->msg->len) {
+		ipmsg_stream_close(st);
+	}
+}
+
+static void ipmsg_stream_serve_read(gpointer data, gint source, GaimInputCondition cond)
+{
+	ipmsg_stream *st = data;
+	unsigned long packetno;
+	ipmsg_longmsg *lm;
+	ssize_t n;
+
+	n = read(st->fd, st->line + st->line_len, sizeof(st->line) - 1 - st->line_len);
+	if (n <= 0) {
+		if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+			ipmsg_stream_fail(st, n == 0 ? "closed" : strerror(errno));
+		}
+		return;
+	}
+	st->line_len += n;
+	st->line[st->line_len] = '\0';
+	if (strchr(st->line, '\n') == NULL) {
+		if (st->line_len == sizeof(st->line) - 1) {
+			ipmsg_stream_fail(st, "bad request");
+		}
+		return;
+	}
+
+	packetno = strtoul(st->line, NULL, 10);
+	lm = g_hash_table_lookup(st->sd->longmsgs, &packetno);
+	if (lm == NULL || lm->addr.sin_addr.s_addr != st->addr.sin_addr.s_addr) {
+		ipmsg_stream_fail(st, "unknown message");
+		return;
+	}
+	st->msg = lm;
+	ipmsg_stream_watch(st, GAIM_INPUT_WRITE, ipmsg_stream_serve_write);
+}
+
+static void ipmsg_longmsg_accept(gpointer data, gint source, GaimInputCondition cond)
+{
+	ipmsg_data *sd = data;
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	ipmsg_stream *st;
+	int fd;
+
+	if ((fd = accept(source, (struct sockaddr *) &sa, &salen)) < 0) {
+		return;
+	}
+	if (sd->serving >= IPMSG_LONGMSG_STREAMS) {
+		/* the sender's RECVMSG never comes and it falls back to its timeout */
+		gaim_debug_warning("ipmsg", "long message stream %s: too many streams\n", inet_ntoa(sa.sin_addr));
+		sd->stats.longmsg.longmsg_refused ++;
+		close(fd);
+		return;
+	}
+	st = ipmsg_stream_new(sd, fd, &sa, TRUE);
+	ipmsg_stream_watch(st, GAIM_INPUT_READ, ipmsg_stream_serve_read);
+}
+
+static void ipmsg_longmsg_listen(ipmsg_data *sd)
+{
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	int fd;
+
+	sd->tcp_fd = -1;
+	sd->longmsgs = g_hash_table_new_full(ipmsg_ulong_hash, ipmsg_ulong_equal, NULL, ipmsg_longmsg_free);
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return;
+	}
+	memset(&sa, '\0', sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = INADDR_ANY;
+	/* any port: the IPMsg one belongs to file transfers of real clients */
+	sa.sin_port = 0;
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(fd, 16) < 0 ||
+	    getsockname(fd, (struct sockaddr *) &sa, &salen) < 0) {
+		/* without a listener our SENDINFO just leaves out the tag */
+		gaim_debug_warning("ipmsg", "long message listener: %s\n", strerror(errno));
+		close(fd);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	sd->tcp_fd = fd;
+	sd->tcp_port = ntohs(sa.sin_port);
+	sd->tcp_inpa = gaim_input_add(fd, GAIM_INPUT_READ, ipmsg_longmsg_accept, sd);
+}
+
+static void ipmsg_longmsg_shutdown(ipmsg_data *sd)
+{
+	while (sd->streams != NULL) {
+		ipmsg_stream_close(sd->streams->data);
+	}
+	if (sd->longmsgs) {
+		g_hash_table_destroy(sd->longmsgs);
+		sd->longmsgs = NULL;
+	}
+	if (sd->tcp_inpa) {
+		gaim_input_remove(sd->tcp_inpa);
+		sd->tcp_inpa = 0;
+	}
+	if (sd->tcp_fd >= 0) {
+		close(sd->tcp_fd);
+		sd->tcp_fd = -1;
+	}
+}
+
+/* receiving side */
+static void ipmsg_stream_fetch_read(gpointer data, gint source, GaimInputCondition cond)
+{
+	ipmsg_stream *st = data;
+	ipmsg_data *sd = st->sd;
+	char ack[24];
+	ssize_t n;
+
+	if (st->done == st->size) {
+		/* the announced length is only an upper bound on what we hold */
+		st->size = MIN(st->size * 2, st->want);
+		st->body = g_realloc(st->body, st->size + 1);
+	}
+	n = read(st->fd, st->body + st->done, st->size - st->done);
+	if (n <= 0) {
+		if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+			ipmsg_stream_fail(st, n == 0 ? "short body" : strerror(errno));
+		}
+		return;
+	}
+	st->done += n;
+	if (st->done < st->want) {
+		return;
+	}
+
+	st->body[st->want] = '\0';
+	sd->stats.longmsg.longmsg_fetched ++;
+	ipmsg_dedupe_claim(sd, &st->addr, &st->pkt);
+	ipmsg_deliver_im(gaim_account_get_connection(sd->account), sd, &st->addr, st->who, &st->pkt,
+	                 st->body, strlen(st->body), &st->deduped);
+	g_snprintf(ack, sizeof(ack), "%lu", st->pkt.packetno);
+	ipmsg_send_msg(sd, &st->addr, IPMSG_RECVMSG, ack);
+	ipmsg_stream_close(st);
+}
+
+static void ipmsg_stream_fetch_connected(gpointer data, gint source, GaimInputCondition cond)
+{
+	ipmsg_stream *st = data;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(st->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+		ipmsg_stream_fail(st, strerror(err ? err : errno));
+		return;
+	}
+	/* the request is a handful of bytes into an empty socket buffer */
+	if (write(st->fd, st->line, st->line_len) != (ssize_t) st->line_len) {
+		ipmsg_stream_fail(st, "request not sent");
+		return;
+	}
+	ipmsg_stream_watch(st, GAIM_INPUT_READ, ipmsg_stream_fetch_read);
+}
+
+static gboolean ipmsg_longmsg_fetching(ipmsg_data *sd, const struct sockaddr_in *sa, unsigned long packetno)
+{
+	GList *l;
+
+	for (l = sd->streams; l != NULL; l = l->next) {
+		ipmsg_stream *st = l->data;
+		if (!st->serving && st->pkt.packetno == packetno && st->addr.sin_addr.s_addr == sa->sin_addr.s_addr) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/* FALSE if pkt is no long message descriptor after all */
+static gboolean ipmsg_longmsg_fetch(ipmsg_data *sd, ipmsg_peer *peer, const ipmsg_packet *pkt)
+{
+	struct sockaddr_in to;
+	unsigned long want;
+	unsigned long port;
+	ipmsg_stream *st;
+	char ack[24];
+	char *end;
+	int fd;
+
+	want = strtoul(pkt->extra, &end, 10);
+	if (end == pkt->extra || *end != ':') {
+		return FALSE;
+	}
+	port = strtoul(end + 1, &end, 10);
+	if (*end != '\0' || port == 0 || port > 65535) {
+		return FALSE;
+	}
+
+	if (ipmsg_is_duplicate(sd, &peer->addr, pkt)) {
+		/* fetched already, our RECVMSG must have been lost */
+		sd->latency.duplicates ++;
+		g_snprintf(ack, sizeof(ack), "%lu", pkt->packetno);
+		ipmsg_send_msg(sd, &peer->addr, IPMSG_RECVMSG, ack);
+		return TRUE;
+	}
+	if (ipmsg_longmsg_fetching(sd, &peer->addr, pkt->packetno)) {
+		sd->latency.duplicates ++;
+		return TRUE;
+	}
+	if (peer->longmsg_port == 0) {
+		/* never told us where to fetch from; the sender's ack times out */
+		gaim_debug_warning("ipmsg", "long message from %s without its SENDINFO\n", inet_ntoa(peer->addr.sin_addr));
+		sd->stats.longmsg.longmsg_failed ++;
+		ipmsg_info_query(sd, peer, &peer->version, IPMSG_GETINFO);
+		return TRUE;
+	}
+	if (sd->fetching >= IPMSG_LONGMSG_STREAMS) {
+		gaim_debug_warning("ipmsg", "long message stream %s: too many streams\n", inet_ntoa(peer->addr.sin_addr));
+		sd->stats.longmsg.longmsg_refused ++;
+		return TRUE;
+	}
+	if (want == 0 || want > IPMSG_LONGMSG_MAX || (fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		sd->stats.longmsg.longmsg_failed ++;
+		return TRUE;
+	}
+
+	st = ipmsg_stream_new(sd, fd, &peer->addr, FALSE);
+	clock_gettime(CLOCK_REALTIME, &st->deduped);
+	st->pkt = *pkt;
+	st->pkt.user = st->pkt.host = st->pkt.extra = NULL;
+	st->pkt.extra_len = 0;
+	g_strlcpy(st->who, peer->uid, sizeof(st->who));
+	st->want = want;
+	st->size = MIN(want, IPMSG_LONGMSG_CHUNK);
+	st->body = g_malloc(st->size + 1);
+	st->line_len = g_snprintf(st->line, sizeof(st->line), "%lu\n", pkt->packetno);
+
+	/* st->addr stays the peer's IPMsg address, the RECVMSG goes there */
+	to = st->addr;
+	to.sin_port = htons(peer->longmsg_port);
+	if (connect(fd, (struct sockaddr *) &to, sizeof(to)) < 0 && errno != EINPROGRESS) {
+		ipmsg_stream_fail(st, strerror(errno));
+		return TRUE;
+	}
+	ipmsg_stream_watch(st, GAIM_INPUT_WRITE, ipmsg_stream_fetch_connected);
+	return TRUE;
+}
+
+/* picks IPMSG_LONGMSG_TAG out of a SENDINFO answer */
+static void ipmsg_longmsg_peer_info(ipmsg_peer *peer, const ipmsg_packet *pkt)
+{
+	const char *tag = strstr(pkt->extra, IPMSG_LONGMSG_TAG);
+	unsigned long port = 0;
+
+	if (tag != NULL) {
+		port = strtoul(tag + strlen(IPMSG_LONGMSG_TAG), NULL, 10);
+	}
+	peer->longmsg_port = port <= 65535 ? port : 0;
+}
+/* }}} */
+
+static void ipmsg_process_packet(GaimConnection *gc, ipmsg_data *sd, const struct sockaddr_in *sa, ipmsg_packet *pkt);
+
+/* {{{ inbound queue
+ * The socket is drained in recvmmsg() batches into a bounded queue, and the
+ * queue is delivered from the main loop in slices. When delivery falls
+ * behind, the kernel buffer stays empty and the overflow policy decides what
+ * is lost: by default chat goes first, since a SENDMSG with SENDCHECKOPT is
+ * sent again until acknowledged (see ipmsg_pending_ack_expire() for ours),
+ * while acks and presence are kept. A message sent without that option is
+ * lost for good.
+ */
+static void ipmsg_inq_free_one(gpointer data, gpointer user_data)
+{
+	g_free(data);
+}
+
+static guint ipmsg_inq_depth(const ipmsg_inq *q)
+{
+	return g_queue_get_length(q->control) + g_queue_get_length(q->chat);
+}
+
+static gboolean ipmsg_inq_deliver(gpointer data)
 {
-	ipmsg_uniqid uid;
-	ipmsg_uniqid_from_user(uid, user);
-	return gaim_find_buddy(account, uid);
+	ipmsg_data *sd = data;
+	GaimConnection *gc = gaim_account_get_connection(sd->account);
+	ipmsg_inpkt *in;
+	int n;
+
+	for (n = 0; n < IPMSG_INQ_BATCH; n ++) {
+		if ((in = g_queue_pop_head(sd->inq.control)) == NULL &&
+		    (in = g_queue_pop_head(sd->inq.chat)) == NULL) {
+			break;
+		}
+		clock_gettime(CLOCK_REALTIME, &in->pkt.dequeued);
+		ipmsg_histogram_add(&sd->latency.queue, &in->pkt.parsed, &in->pkt.dequeued);
+		ipmsg_process_packet(gc, sd, &in->addr, &in->pkt);
+		g_free(in);
+	}
+
+	if (sd->inq.shedding && ipmsg_inq_depth(&sd->inq) <= sd->inq.low) {
+		gaim_debug_info("ipmsg", "inbound queue back under %u\n", sd->inq.low);
+		sd->inq.shedding = FALSE;
+	}
+	if (ipmsg_inq_depth(&sd->inq) == 0) {
+		sd->inq.source = 0;
+		return FALSE;
+	}
+	return TRUE;
 }
 
-#if 0
-static void ipmsg_blist_add_user(GaimAccount *account, const ipmsg_user *user)
+static void ipmsg_inq_push(ipmsg_data *sd, ipmsg_inpkt *in)
 {
-	GaimBuddy *b;
-	ipmsg_uniqid uid;
+	ipmsg_inq *q = &sd->inq;
+	gboolean chat = IPMSG_GET_MODE(in->pkt.cmd) == IPMSG_SENDMSG;
+	guint depth = ipmsg_inq_depth(q);
 
-	ipmsg_uniqid_from_user(uid, user);
-	b = ipmsg_find_buddy(account, user);
+	if (depth >= q->high && !q->shedding) {
+		gaim_debug_warning("ipmsg", "inbound queue at %u, shedding\n", depth);
+		q->shedding = TRUE;
+	}
+	if (q->shedding && (chat || q->policy == IPMSG_INQ_DROP_NEWEST)) {
+		goto drop;
+	}
+	/* shedding chat, acks and presence may still use up to twice the high mark */
+	if (depth >= q->high * 2) {
+		ipmsg_inpkt *old;
 
-	if (b == NULL) {
-		/* create group first */
-		GaimGroup *g = gaim_find_group(IPMSG_GROUPNAME);
-		if (g == NULL) {
-			g = gaim_group_new(IPMSG_GROUPNAME);
-			gaim_blist_add_group(g, NULL);
+		if (chat || (old = g_queue_pop_head(q->chat)) == NULL) {
+			goto drop;
 		}
-
-		b = gaim_buddy_new(account, uid, NULL);
-		gaim_blist_add_buddy(b, NULL, g, NULL);
+		sd->stats.inq.dropped_chat ++;
+		g_free(old);
 	}
 
-	gaim_prpl_got_user_status(account, uid, "available", NULL);
-	serv_got_alias(gaim_account_get_connection(account), uid, user->name);
-}
-#endif
+	g_queue_push_tail(chat ? q->chat : q->control, in);
+	sd->stats.inq.max_depth = MAX(sd->stats.inq.max_depth, depth + 1);
+	if (q->source == 0) {
+		q->source = gaim_timeout_add(0, ipmsg_inq_deliver, sd);
+	}
+	return;
 
-static int ipmsg_send_msg(ipmsg_data *sd, const struct sockaddr_in *sa, unsigned long cmd, const char *msg)
-{
-#define USERNAME_MAX 64
-	char lbuf[2 + 12 + USERNAME_MAX + 1 + 64 + 1 + 12];
-	char *obuf;
-	char *wbuf;
-	int size;
-	int err;
-	snprintf(lbuf, sizeof(lbuf), "1:%ld:%s:%s:%lu:", sd->msgid ++, sd->user.name, sd->user.host, cmd);
-	obuf = lbuf;
-	// obuf = strtoout(lbuf, bro_encoding);
-	size = strlen(obuf) + strlen(msg) + 1;
-	wbuf = malloc(size);
-	strcpy(wbuf, obuf);
-	strcat(wbuf, msg);
-	err = sendto(sd->fd, wbuf, size, 0, (const struct sockaddr *) sa, sizeof(*sa));
-	free(wbuf);
-	// free(obuf);
-	return err;
+drop:
+	if (chat) {
+		sd->stats.inq.dropped_chat ++;
+	}
+	else {
+		sd->stats.inq.dropped_control ++;
+	}
+	g_free(in);
 }
 
-static void ipmsg_brocast_x(ipmsg_data *sd, unsigned long cmd, const char *msg)
+static void ipmsg_inq_init(ipmsg_data *sd)
 {
-	struct sockaddr_in sa;
-	memset(&sa, '\0', sizeof(sa));
-	sa.sin_family = AF_INET;
-	sa.sin_addr.s_addr = inet_addr("255.255.255.255");
-	gaim_debug_info("ipmsg", "test %d\n", sd->user.port);
-	sa.sin_port = htons(sd->user.port);
-	ipmsg_send_msg(sd, &sa, cmd, msg);
-}
+	const char *policy = gaim_account_get_string(sd->account, "inq_policy", "chat");
 
-static void ipmsg_brocast_online(ipmsg_data *sd)
-{
-	gaim_debug_info("ipmsg", "online\n");
-	ipmsg_brocast_x(sd, IPMSG_BR_ENTRY, "");
+	sd->inq.control = g_queue_new();
+	sd->inq.chat = g_queue_new();
+	sd->inq.high = MAX(gaim_account_get_int(sd->account, "inq_high", IPMSG_INQ_HIGH), 16);
+	sd->inq.low = CLAMP(gaim_account_get_int(sd->account, "inq_low", IPMSG_INQ_LOW), 0, sd->inq.high / 2);
+	sd->inq.policy = strcmp(policy, "newest") == 0 ? IPMSG_INQ_DROP_NEWEST : IPMSG_INQ_SHED_CHAT;
+	sd->rx = g_new0(ipmsg_rx, 1);
 }
 
-static void ipmsg_brocast_offline(ipmsg_data *sd)
+static void ipmsg_inq_free(ipmsg_data *sd)
 {
-	gaim_debug_info("ipmsg", "offline\n");
-	ipmsg_brocast_x(sd, IPMSG_BR_EXIT, "");
+	if (sd->inq.source != 0) {
+		gaim_timeout_remove(sd->inq.source);
+		sd->inq.source = 0;
+	}
+	if (sd->inq.control != NULL) {
+		g_queue_foreach(sd->inq.control, ipmsg_inq_free_one, NULL);
+		g_queue_free(sd->inq.control);
+		g_queue_foreach(sd->inq.chat, ipmsg_inq_free_one, NULL);
+		g_queue_free(sd->inq.chat);
+		sd->inq.control = sd->inq.chat = NULL;
+	}
+	g_free(sd->rx);
+	sd->rx = NULL;
 }
+/* }}} */
 
 static gboolean ipmsg_proto_init(ipmsg_data *sd, const char *name, int port)
 {
@@ -169,15 +2849,41 @@ static gboolean ipmsg_proto_init(ipmsg_data *sd, const char *name, int port)
 	gethostname(hostname, sizeof(hostname));
 
 	sd->user.port = port;
-	sd->user.name = g_strdup(name);
-	sd->user.host = g_strdup(hostname);
-	sd->msgid = 0;
+	sd->names = ipmsg_intern_new();
+	sd->user.name = ipmsg_intern(sd->names, name);
+	sd->user.host = ipmsg_intern(sd->names, hostname);
+	/* like every IPMsg client: a restart must not reuse the packet numbers
+	 * of the last session, peers would take our first messages for
+	 * duplicates of those */
+	sd->msgid = time(NULL);
+	sd->tcp_fd = -1;
 	ipmsg_uniqid_from_user(sd->uid, &sd->user);
 
+	sd->peers = g_hash_table_new(ipmsg_addr_hash, ipmsg_addr_equal);
+	sd->peers_by_uid = g_hash_table_new(g_str_hash, g_str_equal);
+	sd->pending_acks = g_hash_table_new_full(ipmsg_ulong_hash, ipmsg_ulong_equal, NULL, ipmsg_pending_ack_free);
+	ipmsg_wheel_init(sd);
+	ipmsg_liveness_init(sd);
+	ipmsg_flood_init(sd);
+	ipmsg_inq_init(sd);
+	ipmsg_lanes_init(sd);
+	ipmsg_sealed_init(sd);
+	ipmsg_blist_init(sd);
+	if (gaim_account_get_bool(sd->account, "capture", FALSE)) {
+		sd->capture = ipmsg_capture_new(IPMSG_CAPTURE_SLOTS, IPMSG_CAPTURE_SNAPLEN);
+	}
+
 	if (fd > 0) {
 		int optval = 1;
 		int err = setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &optval, sizeof(optval));
 
+#ifdef SO_TIMESTAMPNS
+		/* optional, packets without a kernel stamp fall back to the read time */
+		if (err >= 0 && setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &optval, sizeof(optval)) < 0) {
+			gaim_debug_warning("ipmsg", "SO_TIMESTAMPNS: %s\n", strerror(errno));
+		}
+#endif
+
 		if (err >= 0) {
 			struct sockaddr_in sa;
 			memset(&sa, '\0', sizeof(sa));
@@ -195,6 +2901,8 @@ static gboolean ipmsg_proto_init(ipmsg_data *sd, const char *name, int port)
 
 	if (fd >= 0) {
 		sd->fd = fd;
+		ipmsg_rcvbuf_adjust(sd);
+		ipmsg_longmsg_listen(sd);
 		return TRUE;
 	}
 	else {
@@ -205,14 +2913,311 @@ static gboolean ipmsg_proto_init(ipmsg_data *sd, const char *name, int port)
 
 void ipmsg_proto_free(ipmsg_data *sd)
 {
-	if (sd->user.name) {
-		g_free((char *) sd->user.name);
+	gaim_signals_disconnect_by_handle(sd);
+	ipmsg_rediscover_end(sd);
+	ipmsg_timer_del(&sd->rediscover.late);
+	ipmsg_rediscover_save(sd);
+	ipmsg_blist_free(sd);
+	ipmsg_sealed_shutdown(sd);
+	ipmsg_longmsg_shutdown(sd);
+	ipmsg_lanes_free(sd);
+#ifdef IPMSG_HAVE_IO_URING
+	if (sd->uring != NULL) {
+		ipmsg_uring_free(sd->uring);
+		sd->uring = NULL;
+	}
+#endif
+	ipmsg_flood_free(sd);
+	ipmsg_inq_free(sd);
+	ipmsg_wheel_free(sd);
+	if (sd->capture) {
+		ipmsg_capture_free(sd->capture);
+		sd->capture = NULL;
+	}
+	if (sd->pending_acks) {
+		g_hash_table_destroy(sd->pending_acks);
+		sd->pending_acks = NULL;
+	}
+	if (sd->peers_by_uid) {
+		g_hash_table_destroy(sd->peers_by_uid);
+		sd->peers_by_uid = NULL;
+	}
+	if (sd->peers) {
+		g_hash_table_foreach(sd->peers, ipmsg_peer_free_one, sd);
+		g_hash_table_destroy(sd->peers);
+		sd->peers = NULL;
+	}
+	if (sd->names) {
+		ipmsg_intern_unref(sd->names, sd->user.name);
+		ipmsg_intern_unref(sd->names, sd->user.host);
+		ipmsg_intern_free(sd->names);
+		sd->names = NULL;
+	}
+	if (sd->fd >= 0) {
+		close(sd->fd);
+		sd->fd = -1;
+	}
+}
+
+static void ipmsg_process_packet(GaimConnection *gc, ipmsg_data *sd, const struct sockaddr_in *sa, ipmsg_packet *pkt)
+{
+	ipmsg_peer *peer;
+
+	if (ipmsg_intern_peek(sd->names, pkt->user) == sd->user.name &&
+	    ipmsg_intern_peek(sd->names, pkt->host) == sd->user.host) {
+		/* our own broadcast */
+		return;
+	}
+
+	switch (IPMSG_GET_MODE(pkt->cmd)) {
+	case IPMSG_BR_EXIT:
+		peer = ipmsg_peer_lookup(sd, sa);
+		if (peer != NULL) {
+			ipmsg_peer_gone(sd, peer);
+		}
+		return;
+
+	case IPMSG_BR_ENTRY:
+		ipmsg_dedupe_forget(sd, sa);
+		peer = ipmsg_peer_seen(sd, sa, pkt);
+		peer->caps = IPMSG_GET_OPT(pkt->cmd);
+		ipmsg_send_msg(sd, sa, IPMSG_ANSENTRY | sd->caps, sd->user.name);
+		ipmsg_rediscover_answer(sd, sa);
+		ipmsg_blist_add_user(sd, peer);
+		break;
+
+	case IPMSG_ANSENTRY:
+	case IPMSG_BR_ABSENCE:
+		peer = ipmsg_peer_seen(sd, sa, pkt);
+		peer->caps = IPMSG_GET_OPT(pkt->cmd);
+		ipmsg_rediscover_answer(sd, sa);
+		ipmsg_blist_add_user(sd, peer);
+		break;
+
+	case IPMSG_SENDMSG:
+		peer = ipmsg_peer_seen(sd, sa, pkt);
+		if ((pkt->cmd & IPMSG_LONGMSGOPT) && ipmsg_longmsg_fetch(sd, peer, pkt)) {
+			/* acknowledged once the body is in */
+			break;
+		}
+		if (pkt->cmd & IPMSG_SENDCHECKOPT) {
+			char ack[24];
+			g_snprintf(ack, sizeof(ack), "%lu", pkt->packetno);
+			ipmsg_send_msg(sd, sa, IPMSG_RECVMSG, ack);
+		}
+		ipmsg_got_im(gc, sd, peer, pkt);
+		break;
+
+	case IPMSG_RECVMSG:
+		ipmsg_peer_seen(sd, sa, pkt);
+		ipmsg_pending_ack_done(sd, sa, pkt);
+		ipmsg_longmsg_received(sd, sa, strtoul(pkt->extra, NULL, 10));
+		break;
+
+	case IPMSG_READMSG:
+	case IPMSG_DELMSG:
+		ipmsg_peer_seen(sd, sa, pkt);
+		ipmsg_sealed_receipt(sd, sa, pkt);
+		break;
+
+	case IPMSG_SENDINFO:
+		peer = ipmsg_peer_seen(sd, sa, pkt);
+		ipmsg_longmsg_peer_info(peer, pkt);
+		ipmsg_info_store(sd, peer, &peer->version, pkt);
+		break;
+
+	case IPMSG_SENDABSENCEINFO:
+		peer = ipmsg_peer_seen(sd, sa, pkt);
+		ipmsg_info_store(sd, peer, &peer->absence, pkt);
+		break;
+
+	case IPMSG_GETABSENCEINFO:
+		ipmsg_peer_seen(sd, sa, pkt);
+		/* we never go absent */
+		ipmsg_send_msg(sd, sa, IPMSG_SENDABSENCEINFO, "Not absence mode");
+		break;
+
+	case IPMSG_GETINFO:
+		peer = ipmsg_peer_seen(sd, sa, pkt);
+		if (sd->tcp_fd >= 0) {
+			char info[64];
+			if (peer->longmsg_port == 0) {
+				/* it is about to send us long bodies, learn where to fetch them */
+				ipmsg_info_query(sd, peer, &peer->version, IPMSG_GETINFO);
+			}
+			g_snprintf(info, sizeof(info), "%s %s%s%d", PACKAGE_NAME, PACKAGE_VERSION_STRING,
+			           IPMSG_LONGMSG_TAG, sd->tcp_port);
+			ipmsg_send_msg(sd, sa, IPMSG_SENDINFO, info);
+		}
+		else {
+			ipmsg_send_msg(sd, sa, IPMSG_SENDINFO, PACKAGE_NAME " " PACKAGE_VERSION_STRING);
+		}
+		break;
+
+	default:
+		/* anything else still proves the peer is alive */
+		ipmsg_peer_seen(sd, sa, pkt);
+		break;
+	}
+}
+
+/* one received datagram: stamp, rate limit, parse a private copy and queue it */
+static void ipmsg_input_one(ipmsg_data *sd, const struct sockaddr_in *sa, const char *buf, size_t len,
+                            const struct timespec *stamp)
+{
+	struct timespec rx;
+	ipmsg_inpkt *in;
+
+	if (sd->capture != NULL) {
+		ipmsg_capture_add(sd->capture, FALSE, sa, buf, len);
+	}
+	sd->stats.packets_in ++;
+
+	if (stamp != NULL) {
+		rx = *stamp;
+		sd->latency.kernel_stamps ++;
+	}
+	else {
+		clock_gettime(CLOCK_REALTIME, &rx);
+	}
+
+	if (!ipmsg_flood_admit(sd, sa, &rx)) {
+		return;
+	}
+
+	in = g_malloc(G_STRUCT_OFFSET(ipmsg_inpkt, data) + len + 1);
+	in->addr = *sa;
+	in->len = len;
+	memcpy(in->data, buf, len);
+	in->data[len] = '\0';
+	in->pkt.rx = rx;
+	if (!ipmsg_packet_parse(&in->pkt, in->data, len)) {
+		sd->stats.bad_packets ++;
+		g_free(in);
+		return;
+	}
+	clock_gettime(CLOCK_REALTIME, &in->pkt.parsed);
+	in->pkt.dequeued = in->pkt.parsed;
+	ipmsg_histogram_add(&sd->latency.parse, &in->pkt.rx, &in->pkt.parsed);
+
+	ipmsg_inq_push(sd, in);
+}
+
+static const struct timespec *ipmsg_input_stamp(struct msghdr *mh, struct timespec *stamp)
+{
+#ifdef SO_TIMESTAMPNS
+	struct cmsghdr *cmsg;
+
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg != NULL; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(stamp, CMSG_DATA(cmsg), sizeof(*stamp));
+			return stamp;
+		}
+	}
+#endif
+	return NULL;
+}
+
+static int ipmsg_input_batch(ipmsg_data *sd, int fd)
+{
+	ipmsg_rx *rx = sd->rx;
+	int i;
+
+	for (i = 0; i < IPMSG_DRAIN_BATCH; i ++) {
+		struct msghdr *mh = &rx->msgs[i].msg_hdr;
+
+		rx->iov[i].iov_base = rx->bufs[i];
+		rx->iov[i].iov_len = IPMSG_MAX_PACKET;
+		memset(mh, '\0', sizeof(*mh));
+		mh->msg_name = &rx->addr[i];
+		mh->msg_namelen = sizeof(rx->addr[i]);
+		mh->msg_iov = &rx->iov[i];
+		mh->msg_iovlen = 1;
+		mh->msg_control = rx->cmsg[i];
+		mh->msg_controllen = sizeof(rx->cmsg[i]);
+	}
+
+#ifdef IPMSG_HAVE_RECVMMSG
+	return recvmmsg(fd, rx->msgs, IPMSG_DRAIN_BATCH, MSG_DONTWAIT, NULL);
+#else
+	{
+		ssize_t len = recvmsg(fd, &rx->msgs[0].msg_hdr, MSG_DONTWAIT);
+		if (len < 0) {
+			return -1;
+		}
+		rx->msgs[0].msg_len = len;
+		return 1;
+	}
+#endif
+}
+
+static void ipmsg_input_cb(gpointer data, gint source, GaimInputCondition cond)
+{
+	GaimConnection *gc = data;
+	ipmsg_data *sd = gc->proto_data;
+	struct timespec stamp;
+	int total = 0;
+	int n, i;
+
+	sd->stats.inq.drains ++;
+	while (total < IPMSG_DRAIN_MAX) {
+		if ((n = ipmsg_input_batch(sd, source)) <= 0) {
+			if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				gaim_debug_warning("ipmsg", "recvmmsg: %s\n", strerror(errno));
+				ipmsg_capture_error(sd, "recvmmsg");
+			}
+			break;
+		}
+		sd->stats.inq.batches ++;
+		for (i = 0; i < n; i ++) {
+			ipmsg_input_one(sd, &sd->rx->addr[i], sd->rx->bufs[i], sd->rx->msgs[i].msg_len,
+			                ipmsg_input_stamp(&sd->rx->msgs[i].msg_hdr, &stamp));
+		}
+		total += n;
+		if (n < IPMSG_DRAIN_BATCH) {
+			break;
+		}
+	}
+}
+
+#ifdef IPMSG_HAVE_IO_URING
+static void ipmsg_uring_datagram(const struct sockaddr_in *from, const char *buf, size_t len,
+                                 const struct timespec *stamp, gpointer data)
+{
+	ipmsg_input_one(data, from, buf, len, stamp);
+}
+
+static void ipmsg_uring_input_cb(gpointer data, gint source, GaimInputCondition cond)
+{
+	GaimConnection *gc = data;
+	ipmsg_data *sd = gc->proto_data;
+
+	sd->stats.inq.drains ++;
+	if (ipmsg_uring_reap(sd->uring, ipmsg_uring_datagram, sd) < 0) {
+		/* e.g. no multishot recvmsg before Linux 6.0 */
+		gaim_debug_warning("ipmsg", "io_uring receive: %s, falling back to recvmmsg\n", strerror(errno));
+		gaim_input_remove(gc->inpa);
+		ipmsg_uring_free(sd->uring);
+		sd->uring = NULL;
+		gc->inpa = gaim_input_add(sd->fd, GAIM_INPUT_READ, ipmsg_input_cb, gc);
 	}
-	if (sd->user.host) {
-		g_free((char *) sd->user.host);
+}
+#endif
+
+/* io_uring when built in and the kernel has it, readiness and recvmmsg otherwise */
+static void ipmsg_io_start(GaimConnection *gc)
+{
+	ipmsg_data *sd = gc->proto_data;
+
+#ifdef IPMSG_HAVE_IO_URING
+	sd->uring = ipmsg_uring_new(sd->fd, IPMSG_URING_BUFS, IPMSG_MAX_PACKET + IPMSG_URING_BUF_SLACK);
+	if (sd->uring != NULL) {
+		gc->inpa = gaim_input_add(ipmsg_uring_eventfd(sd->uring), GAIM_INPUT_READ, ipmsg_uring_input_cb, gc);
+		return;
 	}
-	close(sd->fd);
-	sd->fd = 0;
+	gaim_debug_info("ipmsg", "io_uring unavailable: %s, using recvmmsg\n", strerror(errno));
+#endif
+	gc->inpa = gaim_input_add(sd->fd, GAIM_INPUT_READ, ipmsg_input_cb, gc);
 }
 
 static void ipmsg_login(GaimAccount *account)
@@ -230,17 +3235,36 @@ static void ipmsg_login(GaimAccount *account)
 	name = gaim_account_get_username(account);
 	port = gaim_account_get_int(account, "port", IPMSG_DEFAULT_PORT);
 	if (ipmsg_proto_init(sd, name, port) != TRUE) {
+		/* nothing to say goodbye on, ipmsg_close() must find nothing left */
 		ipmsg_proto_free(sd);
+		g_free(sd);
+		gc->proto_data = NULL;
+		gaim_connection_error(gc, _("Unable to bind the IPMsg port"));
 		return;
 	}
 
 	gaim_connection_set_state(gc, GAIM_CONNECTED);
+	ipmsg_io_start(gc);
 
 	if (gaim_account_get_bool(gc->account, "clear_offline", FALSE)) {
 		ipmsg_clear_offline(account);
 	}
 
-	ipmsg_brocast_online(sd);
+	gaim_signal_connect(gaim_network_get_handle(), "network-configuration-changed", sd,
+	                    GAIM_CALLBACK(ipmsg_network_changed), sd);
+	ipmsg_rediscover(sd, TRUE);
+}
+
+/* the reverse of ipmsg_legacy_to_utf8() */
+static char *ipmsg_utf8_to_legacy(ipmsg_data *sd, const char *str)
+{
+	const char *encoding = gaim_account_get_string(sd->account, "encoding", IPMSG_DEFAULT_ENCODING);
+	char *out = NULL;
+
+	if (g_ascii_strcasecmp(encoding, "UTF-8") != 0) {
+		out = g_convert_with_fallback(str, -1, encoding, "UTF-8", "?", NULL, NULL, NULL);
+	}
+	return out != NULL ? out : g_strdup(str);
 }
 
 static int ipmsg_send_im(GaimConnection *gc,
@@ -248,14 +3272,92 @@ static int ipmsg_send_im(GaimConnection *gc,
                          const char *what,
                          GaimMessageFlags flags)
 {
-	struct ipmsg_data *sd;
+	ipmsg_data *sd;
+	ipmsg_peer *peer;
+	unsigned long packetno;
+	unsigned long cmd = IPMSG_SENDMSG | IPMSG_SENDCHECKOPT;
+	ipmsg_sealed *sealed = NULL;
+	char *plain;
+	char *body;
+	int err;
 
 	gaim_debug_info("ipmsg", "ipmsg_send_im\n");
 	sd = gc->proto_data;
 
+	if ((peer = g_hash_table_lookup(sd->peers_by_uid, who)) == NULL) {
+		return -ENOTCONN;
+	}
+
+	ipmsg_blist_chatting(sd, who);
+	plain = gaim_markup_strip_html(what);
+	body = ipmsg_utf8_to_legacy(sd, plain);
+	g_free(plain);
+
+	packetno = sd->msgid ++;
+	if (gaim_account_get_bool(sd->account, "seal", FALSE)) {
+		cmd |= IPMSG_SECRETOPT;
+		sealed = ipmsg_sealed_sent(sd, peer, packetno);
+	}
+	if (strlen(body) > IPMSG_LONGMSG_THRESHOLD && peer->longmsg_port != 0 && sd->tcp_fd >= 0) {
+		char desc[32];
+		g_snprintf(desc, sizeof(desc), "%lu:%d", (unsigned long) strlen(body), sd->tcp_port);
+		ipmsg_longmsg_add(sd, packetno, &peer->addr, body);
+		cmd |= IPMSG_LONGMSGOPT;
+		body = g_strdup(desc);
+	}
+	else if (strlen(body) > IPMSG_LONGMSG_THRESHOLD && sd->tcp_fd >= 0) {
+		/* fragmented this time; its SENDINFO tells whether it can fetch the next one */
+		ipmsg_info_query(sd, peer, &peer->version, IPMSG_GETINFO);
+	}
+	/* armed first, the packet may be sent and answered before the lane returns */
+	ipmsg_pending_ack_add(sd, packetno, &peer->addr, who, cmd, body);
+	err = ipmsg_send_packet(sd, &peer->addr, packetno, cmd, body);
+	g_free(body);
+	if (err < 0) {
+		err = errno;
+		/* nothing went out, so nothing will answer */
+		g_hash_table_remove(sd->pending_acks, &packetno);
+		if (sealed != NULL) {
+			ipmsg_sealed_remove(sd, sealed);
+			sd->stats.seal.sealed_out --;
+		}
+		ipmsg_longmsg_done(sd, packetno);
+		return -err;
+	}
 	return 1;
 }
 
+typedef struct {
+	ipmsg_data *sd;
+	const char *body;
+} ipmsg_announce_ctx;
+
+static void ipmsg_announce_one(gpointer key, gpointer value, gpointer data)
+{
+	ipmsg_announce_ctx *ctx = data;
+	ipmsg_peer *peer = value;
+
+	ipmsg_send_msg(ctx->sd, &peer->addr, IPMSG_SENDMSG | IPMSG_BROADCASTOPT, ctx->body);
+}
+
+static void ipmsg_announce_cb(GaimConnection *gc, const char *text)
+{
+	ipmsg_data *sd = gc->proto_data;
+	ipmsg_announce_ctx ctx;
+	char *body;
+
+	if (sd == NULL || text == NULL || *text == '\0') {
+		return;
+	}
+
+	/* one SENDMSG per peer, all on the announcement lane */
+	body = ipmsg_utf8_to_legacy(sd, text);
+	ctx.sd = sd;
+	ctx.body = body;
+	g_hash_table_foreach(sd->peers, ipmsg_announce_one, &ctx);
+	g_free(body);
+}
+
 static void ipmsg_reset(GaimConnection *gc, ipmsg_data *sd)
 {
 	gaim_debug_info("ipmsg", "ipmsg_reset\n");
@@ -278,6 +3380,7 @@ static void ipmsg_close(GaimConnection *gc)
 	ipmsg_brocast_offline(sd);
 	ipmsg_reset(gc, sd);
 	g_free(sd);
+	gc->proto_data = NULL;
 }
 
 #if 0
@@ -311,6 +3414,252 @@ static GList *ipmsg_status_types(GaimAccount *account)
 	return types;
 }
 
+static void ipmsg_show_stats(GaimPluginAction *action)
+{
+	GaimConnection *gc = action->context;
+	ipmsg_data *sd = gc->proto_data;
+	ipmsg_intern_stats names;
+	GString *str;
+
+	if (sd == NULL) {
+		return;
+	}
+
+	str = g_string_new(NULL);
+	g_string_append_printf(str, "<b>%s</b> %u<br>", _("Known peers:"), g_hash_table_size(sd->peers));
+	ipmsg_intern_get_stats(sd->names, &names);
+	g_string_append_printf(str, "<b>%s</b> %u strings, %lu refs, %lu bytes in %lu reserved, %lu bytes shared<br>",
+	                       _("Names:"), names.strings, names.refs, names.bytes, names.arena, names.saved);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Packets received:"), sd->stats.packets_in);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Packets sent:"), sd->stats.packets_out);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Malformed packets:"), sd->stats.bad_packets);
+	g_string_append_printf(str, "<b>%s</b> %u queued, %lu max, %lu chat dropped, %lu control dropped<br>",
+	                       _("Inbound queue:"), ipmsg_inq_depth(&sd->inq), sd->stats.inq.max_depth,
+	                       sd->stats.inq.dropped_chat, sd->stats.inq.dropped_control);
+	g_string_append_printf(str, "<b>%s</b> %lu wakeups, %lu batches, SO_RCVBUF %d<br>", _("Socket draining:"),
+	                       sd->stats.inq.drains, sd->stats.inq.batches, sd->rcvbuf);
+#ifdef IPMSG_HAVE_IO_URING
+	if (sd->uring != NULL) {
+		ipmsg_uring_stats us;
+
+		ipmsg_uring_get_stats(sd->uring, &us);
+		g_string_append_printf(str, "<b>%s</b> %lu received, %lu truncated, %lu re-arms, %lu out of buffers, "
+		                       "%lu sent in %lu submits, %lu send errors<br>", _("io_uring:"),
+		                       us.received, us.truncated, us.rearms, us.nobufs, us.sends, us.submits, us.send_errors);
+	}
+#endif
+	g_string_append_printf(str, "<b>%s</b> %lu dropped, %lu mutes, %u hosts tracked, muted now:", _("Flood protection:"),
+	                       sd->stats.flood.dropped, sd->stats.flood.mutes, g_hash_table_size(sd->flood));
+	g_hash_table_foreach(sd->flood, ipmsg_flood_append_muted, str);
+	g_string_append(str, "<br>");
+	g_string_append_printf(str, "<b>%s</b> %lu runs, %lu unicast probes, %lu answers, %lu broadcast fallbacks, %lu deferred broadcasts<br>",
+	                       _("Rediscovery:"), sd->stats.rediscover.runs, sd->stats.rediscover.probes,
+	                       sd->stats.rediscover.answers, sd->stats.rediscover.fallbacks,
+	                       sd->stats.rediscover.deferred);
+	g_string_append_printf(str, "<b>%s</b> %us<br>", _("Liveness interval:"), sd->live.interval);
+	g_string_append_printf(str, "<b>%s</b> %.1f/min<br>", _("Peer churn:"), sd->live.churn);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Liveness probes sent:"), sd->stats.probes_sent);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Liveness probes deferred:"), sd->stats.probes_deferred);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Peers timed out:"), sd->stats.peers_expired);
+	g_string_append_printf(str, "<b>%s</b> %lu sent, %lu shared, %lu cache hits<br>", _("Info queries:"),
+	                       sd->stats.info_queries, sd->stats.info_shared, sd->stats.info_hits);
+	g_string_append_printf(str, "<b>%s</b> %lu batches, %lu created, %lu renamed, %lu unchanged<br>", _("Buddy list:"),
+	                       sd->stats.blist.batches, sd->stats.blist.created, sd->stats.blist.aliased,
+	                       sd->stats.blist.unchanged);
+	if (sd->virtual_roster) {
+		g_string_append_printf(str, "<b>%s</b> %lu kept out, %lu transient dropped<br>", _("Virtual roster:"),
+		                       sd->stats.blist.virtualized, sd->stats.blist.dropped);
+	}
+
+	if (sd->capture != NULL) {
+		g_string_append_printf(str, "<b>%s</b> %u<br>", _("Datagrams captured:"), ipmsg_capture_count(sd->capture));
+	}
+
+	g_string_append_printf(str, "<br><b>%s</b> %lu sent, %lu paced, %u deepest<br>", _("Control lane:"),
+	                       sd->lanes[IPMSG_LANE_CONTROL].sent, sd->lanes[IPMSG_LANE_CONTROL].waited,
+	                       sd->lanes[IPMSG_LANE_CONTROL].max_depth);
+	g_string_append_printf(str, "<b>%s</b> %lu sent, %lu paced, %u deepest<br>", _("Bulk lane:"),
+	                       sd->lanes[IPMSG_LANE_BULK].sent, sd->lanes[IPMSG_LANE_BULK].waited,
+	                       sd->lanes[IPMSG_LANE_BULK].max_depth);
+	g_string_append_printf(str, "<b>%s</b> %lu sent, %lu paced, %u deepest<br>", _("Announcement lane:"),
+	                       sd->lanes[IPMSG_LANE_ANNOUNCE].sent, sd->lanes[IPMSG_LANE_ANNOUNCE].waited,
+	                       sd->lanes[IPMSG_LANE_ANNOUNCE].max_depth);
+
+	g_string_append_printf(str, "<b>%s</b> %lu sent, %lu fetched, %lu failed, %lu streams refused<br>", _("Long messages:"),
+	                       sd->stats.longmsg.longmsg_sent, sd->stats.longmsg.longmsg_fetched,
+	                       sd->stats.longmsg.longmsg_failed, sd->stats.longmsg.longmsg_refused);
+
+	g_string_append_printf(str, "<b>%s</b> %lu in, %lu out, %lu opened, %lu deleted, %lu expired, %u pending<br>",
+	                       _("Sealed messages:"), sd->stats.seal.sealed_in, sd->stats.seal.sealed_out,
+	                       sd->stats.seal.opened, sd->stats.seal.deleted, sd->stats.seal.expired,
+	                       sd->sealed_count);
+
+	g_string_append_printf(str, "<br><b>%s</b> %lu<br>", _("Kernel timestamps:"), sd->latency.kernel_stamps);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Duplicate messages:"), sd->latency.duplicates);
+	ipmsg_histogram_print(str, _("Receive to parse:"), &sd->latency.parse);
+	ipmsg_histogram_print(str, _("Parse to dequeue:"), &sd->latency.queue);
+	ipmsg_histogram_print(str, _("Dequeue to dedupe:"), &sd->latency.dedupe);
+	ipmsg_histogram_print(str, _("Dedupe to delivery:"), &sd->latency.deliver);
+	ipmsg_histogram_print(str, _("Receive to delivery:"), &sd->latency.total);
+	ipmsg_histogram_print(str, _("Send to ack:"), &sd->latency.ack);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Messages resent:"), sd->latency.acks_resent);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Acks lost:"), sd->latency.acks_lost);
+
+	gaim_notify_formatted(gc, _("IPMsg Statistics"), _("Protocol statistics"), NULL, str->str, NULL, NULL);
+	g_string_free(str, TRUE);
+}
+
+/* {{{ LAN directory
+ * With the virtual roster most peers have no blist node; the directory
+ * searches the peer table instead and can open a conversation or pin a peer.
+ */
+typedef struct {
+	char *needle;
+	GaimNotifySearchResults *results;
+	unsigned int found;
+	unsigned int matched;
+} ipmsg_directory_search;
+
+static void ipmsg_directory_match(gpointer key, gpointer value, gpointer data)
+{
+	ipmsg_directory_search *ds = data;
+	ipmsg_peer *peer = value;
+	GList *row = NULL;
+
+	if (*ds->needle != '\0' && strstr(peer->search, ds->needle) == NULL) {
+		return;
+	}
+	ds->matched ++;
+	if (ds->found >= IPMSG_DIRECTORY_MAX_RESULTS) {
+		return;
+	}
+	row = g_list_append(row, g_strdup(peer->uid));
+	row = g_list_append(row, g_strdup(peer->user.name));
+	row = g_list_append(row, g_strdup(peer->user.host));
+	row = g_list_append(row, g_strdup(inet_ntoa(peer->addr.sin_addr)));
+	gaim_notify_searchresults_row_add(ds->results, row);
+	ds->found ++;
+}
+
+static void ipmsg_directory_im(GaimConnection *gc, GList *row, gpointer data)
+{
+	gaim_conversation_new(GAIM_CONV_TYPE_IM, gaim_connection_get_account(gc), g_list_nth_data(row, 0));
+}
+
+static void ipmsg_directory_pin(GaimConnection *gc, GList *row, gpointer data)
+{
+	ipmsg_data *sd = gc->proto_data;
+	ipmsg_peer *peer = g_hash_table_lookup(sd->peers_by_uid, g_list_nth_data(row, 0));
+
+	if (peer != NULL) {
+		ipmsg_blist_pin(sd, peer);
+	}
+}
+
+static void ipmsg_directory_cb(GaimConnection *gc, const char *text)
+{
+	ipmsg_data *sd = gc->proto_data;
+	ipmsg_directory_search ds;
+	char *query;
+	char *secondary;
+
+	if (sd == NULL) {
+		return;
+	}
+
+	query = g_strstrip(g_strdup(text != NULL ? text : ""));
+	ds.needle = g_utf8_casefold(query, -1);
+	g_free(query);
+	ds.results = gaim_notify_searchresults_new();
+	ds.found = ds.matched = 0;
+	gaim_notify_searchresults_column_add(ds.results, gaim_notify_searchresults_column_new(_("ID")));
+	gaim_notify_searchresults_column_add(ds.results, gaim_notify_searchresults_column_new(_("User")));
+	gaim_notify_searchresults_column_add(ds.results, gaim_notify_searchresults_column_new(_("Host")));
+	gaim_notify_searchresults_column_add(ds.results, gaim_notify_searchresults_column_new(_("Address")));
+	gaim_notify_searchresults_button_add(ds.results, GAIM_NOTIFY_BUTTON_IM, ipmsg_directory_im);
+	gaim_notify_searchresults_button_add(ds.results, GAIM_NOTIFY_BUTTON_ADD, ipmsg_directory_pin);
+
+	g_hash_table_foreach(sd->peers, ipmsg_directory_match, &ds);
+	g_free(ds.needle);
+
+	if (ds.found == 0) {
+		gaim_notify_searchresults_free(ds.results);
+		gaim_notify_info(gc, _("LAN Directory"), _("No peers found"), NULL);
+		return;
+	}
+	secondary = g_strdup_printf(_("%u of %u online peers match, showing %u."),
+	                            ds.matched, g_hash_table_size(sd->peers), ds.found);
+	gaim_notify_searchresults(gc, _("LAN Directory"), _("Peers on the LAN"), secondary, ds.results, NULL, NULL);
+	g_free(secondary);
+}
+
+static void ipmsg_directory(GaimPluginAction *action)
+{
+	GaimConnection *gc = action->context;
+
+	gaim_request_input(gc, _("LAN Directory"), _("Search peers on the LAN"),
+	                   _("Matches user names, host names and addresses. Leave empty to list everyone."),
+	                   NULL, FALSE, FALSE, NULL,
+	                   _("Search"), G_CALLBACK(ipmsg_directory_cb),
+	                   _("Cancel"), NULL, gc);
+}
+/* }}} */
+
+static void ipmsg_announce(GaimPluginAction *action)
+{
+	GaimConnection *gc = action->context;
+
+	gaim_request_input(gc, _("IPMsg Announcement"), _("Send a message to every known peer"), NULL,
+	                   NULL, TRUE, FALSE, NULL,
+	                   _("Send"), G_CALLBACK(ipmsg_announce_cb),
+	                   _("Cancel"), NULL, gc);
+}
+
+static void ipmsg_rediscover_action(GaimPluginAction *action)
+{
+	GaimConnection *gc = action->context;
+	ipmsg_data *sd = gc->proto_data;
+
+	if (sd != NULL) {
+		ipmsg_rediscover(sd, FALSE);
+	}
+}
+
+static void ipmsg_save_capture(GaimPluginAction *action)
+{
+	GaimConnection *gc = action->context;
+	ipmsg_data *sd = gc->proto_data;
+	char *filename;
+
+	if (sd == NULL) {
+		return;
+	}
+	if (sd->capture == NULL) {
+		gaim_notify_error(gc, _("IPMsg Capture"), _("Traffic capture is disabled"),
+		                  _("Enable \"Capture traffic\" in the account options and reconnect."));
+		return;
+	}
+
+	if ((filename = ipmsg_capture_save(sd)) == NULL) {
+		gaim_notify_error(gc, _("IPMsg Capture"), _("Could not write the capture file"), strerror(errno));
+		return;
+	}
+	gaim_notify_info(gc, _("IPMsg Capture"), _("Traffic capture saved"), filename);
+	g_free(filename);
+}
+
+static GList *ipmsg_actions(GaimPlugin *plugin, gpointer context)
+{
+	GList *m = NULL;
+
+	m = g_list_append(m, gaim_plugin_action_new(_("LAN Directory..."), ipmsg_directory));
+	m = g_list_append(m, gaim_plugin_action_new(_("Send Announcement..."), ipmsg_announce));
+	m = g_list_append(m, gaim_plugin_action_new(_("Rediscover Peers"), ipmsg_rediscover_action));
+	m = g_list_append(m, gaim_plugin_action_new(_("Show Statistics"), ipmsg_show_stats));
+	m = g_list_append(m, gaim_plugin_action_new(_("Save Traffic Capture"), ipmsg_save_capture));
+	return m;
+}
+
 static GaimPluginProtocolInfo prpl_info =
 {
 	OPT_PROTO_NO_PASSWORD,         /* options */
@@ -320,7 +3669,7 @@ static GaimPluginProtocolInfo prpl_info =
 	ipmsg_icon,                    /* list_icon */
 	NULL,                          /* list_emblems */
 	NULL,                          /* status_text */
-	NULL,                          /* tooltip_text */
+	ipmsg_tooltip_text,            /* tooltip_text */
 	ipmsg_status_types,            /* status_types */
 	NULL,                          /* blist_node_menu */
 	NULL,                          /* chat_info */
@@ -330,7 +3679,7 @@ static GaimPluginProtocolInfo prpl_info =
 	ipmsg_send_im,                 /* send_im */
 	NULL,                          /* set_info */
 	NULL,                          /* send_typing */
-	NULL,                          /* get_info */
+	ipmsg_get_info,                /* get_info */
 	NULL,                          /* set_away */
 	NULL,                          /* set_idle */
 	NULL,                          /* change_password */
@@ -381,6 +3730,25 @@ static gboolean plugin_load(GaimPlugin *plugin)
 	ADD_OPTION(gaim_account_option_int_new(_("Port"), "port", IPMSG_DEFAULT_PORT));
 	ADD_OPTION(gaim_account_option_string_new(_("Encoding"), "encoding", IPMSG_DEFAULT_ENCODING));
 	ADD_OPTION(gaim_account_option_bool_new(_("Clear offline"), "clear_offline", FALSE));
+	ADD_OPTION(gaim_account_option_bool_new(_("Seal outgoing messages"), "seal", FALSE));
+	ADD_OPTION(gaim_account_option_bool_new(_("Capture traffic"), "capture", FALSE));
+	ADD_OPTION(gaim_account_option_bool_new(_("Only list pinned and recent peers"), "virtual_roster", FALSE));
+	ADD_OPTION(gaim_account_option_int_new(_("Inbound queue high watermark"), "inq_high", IPMSG_INQ_HIGH));
+	ADD_OPTION(gaim_account_option_int_new(_("Inbound queue low watermark"), "inq_low", IPMSG_INQ_LOW));
+	{
+		GList *policies = NULL;
+		GaimKeyValuePair *kvp;
+
+		kvp = g_new0(GaimKeyValuePair, 1);
+		kvp->key = g_strdup(_("Drop chat, keep acks and presence"));
+		kvp->value = g_strdup("chat");
+		policies = g_list_append(policies, kvp);
+		kvp = g_new0(GaimKeyValuePair, 1);
+		kvp->key = g_strdup(_("Drop everything new"));
+		kvp->value = g_strdup("newest");
+		policies = g_list_append(policies, kvp);
+		ADD_OPTION(gaim_account_option_list_new(_("Inbound queue overflow"), "inq_policy", policies));
+	}
 
 	_ipmsg_plugin = plugin;
 	return TRUE;
@@ -414,7 +3782,7 @@ static GaimPluginInfo plugin_info =
 	NULL,                            /* ui_info */
 	&prpl_info,                      /* extra_info */
 	NULL,                            /* prefs_info */
-	NULL                             /* actions */
+	ipmsg_actions                    /* actions */
 };
 
 static void plugin_init(GaimPlugin *plugin)
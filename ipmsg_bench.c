@@ -0,0 +1,269 @@
+/* vim:ts=4:sw=4:noet
+ */
+/* micro benchmark for the IPMsg hot paths, not installed
+ * build with: cmake -DIPMSG_BENCHMARK=ON
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg() */
+#endif
+
+#include "ipmsg_utf8.h"
+#ifdef IPMSG_HAVE_IO_URING
+#include "ipmsg_uring.h"
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+/* socket backends: bursts of small datagrams over loopback */
+#define BENCH_DGRAMS    256
+#define BENCH_DGRAM_LEN 200
+#define BENCH_ROUNDS    2000
+#define BENCH_BATCH     32
+#define BENCH_RECV_WAIT 0.1  /* seconds a receiver waits for the rest of a burst */
+
+typedef gboolean (*bench_kernel)(const char *buf, size_t len);
+
+static double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static gboolean bench_glib(const char *buf, size_t len)
+{
+	return g_utf8_validate(buf, len, NULL);
+}
+
+/* typical message bodies: plain ASCII, mixed CJK chat and a legacy code page body */
+static char *bench_body(const char *unit, size_t len)
+{
+	char *buf = g_malloc(len + 1);
+	size_t ulen = strlen(unit);
+	size_t i;
+
+	for (i = 0; i + ulen <= len; i += ulen) {
+		memcpy(buf + i, unit, ulen);
+	}
+	memset(buf + i, 'x', len - i);
+	buf[len] = '\0';
+	return buf;
+}
+
+static void bench_run(const char *name, bench_kernel kernel, const char *buf, size_t len)
+{
+	size_t rounds = BENCH_BYTES / len;
+	size_t i;
+	gboolean ok = TRUE;
+	double t;
+
+	t = bench_now();
+	for (i = 0; i < rounds; i ++) {
+		ok &= kernel(buf, len);
+	}
+	t = bench_now() - t;
+	printf("  %-16s %8.1f MB/s  %s\n", name, rounds * len / t / 1e6, ok ? "valid" : "invalid");
+}
+
+static void bench_utf8(const char *title, const char *unit, size_t len)
+{
+	char *buf = bench_body(unit, len);
+
+	printf("utf8 %s, %lu bytes\n", title, (unsigned long) len);
+	bench_run("g_utf8_validate", bench_glib, buf, len);
+	bench_run("scalar", ipmsg_utf8_validate_scalar, buf, len);
+#ifdef IPMSG_UTF8_X86
+	bench_run("sse2", ipmsg_utf8_validate_sse2, buf, len);
+	if (__builtin_cpu_supports("avx2")) {
+		bench_run("avx2", ipmsg_utf8_validate_avx2, buf, len);
+	}
+#endif
+	g_free(buf);
+}
+
+static int bench_socket(struct sockaddr_in *sa)
+{
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int size = 4 * 1024 * 1024;
+	socklen_t len = sizeof(*sa);
+
+	memset(sa, '\0', sizeof(*sa));
+	sa->sin_family = AF_INET;
+	sa->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	bind(fd, (struct sockaddr *) sa, sizeof(*sa));
+	getsockname(fd, (struct sockaddr *) sa, &len);
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	return fd;
+}
+
+static const char bench_dgram[BENCH_DGRAM_LEN] = "1:1:user:host:32:hello";
+
+static void bench_send_sendto(int tx, const struct sockaddr_in *to, void *ctx)
+{
+	int i;
+
+	for (i = 0; i < BENCH_DGRAMS; i ++) {
+		sendto(tx, bench_dgram, sizeof(bench_dgram), 0, (const struct sockaddr *) to, sizeof(*to));
+	}
+}
+
+static int bench_recv_recvmsg(int rx, void *ctx)
+{
+	char buf[2048];
+	int n = 0;
+
+	while (recv(rx, buf, sizeof(buf), MSG_DONTWAIT) >= 0) {
+		n ++;
+	}
+	return n;
+}
+
+#ifdef MSG_WAITFORONE
+static int bench_recv_recvmmsg(int rx, void *ctx)
+{
+	static char bufs[BENCH_BATCH][2048];
+	struct mmsghdr msgs[BENCH_BATCH];
+	struct iovec iov[BENCH_BATCH];
+	int n = 0;
+	int got;
+	int i;
+
+	do {
+		memset(msgs, '\0', sizeof(msgs));
+		for (i = 0; i < BENCH_BATCH; i ++) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = sizeof(bufs[i]);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		if ((got = recvmmsg(rx, msgs, BENCH_BATCH, MSG_DONTWAIT, NULL)) > 0) {
+			n += got;
+		}
+	} while (got == BENCH_BATCH);
+	return n;
+}
+#endif
+
+#ifdef IPMSG_HAVE_IO_URING
+static void bench_uring_count(const struct sockaddr_in *from, const char *buf, size_t len,
+                              const struct timespec *stamp, gpointer data)
+{
+}
+
+static unsigned long bench_uring_send_failed;
+
+static void bench_send_uring(int tx, const struct sockaddr_in *to, void *ctx)
+{
+	ipmsg_uring *u = ctx;
+	int i;
+
+	for (i = 0; i < BENCH_DGRAMS; i ++) {
+		if (!ipmsg_uring_sendto(u, 0, to, bench_dgram, sizeof(bench_dgram))) {
+			bench_uring_send_failed ++;
+		}
+	}
+	ipmsg_uring_submit(u);
+	/* collect completions so send buffers are released */
+	ipmsg_uring_reap(u, bench_uring_count, NULL);
+}
+
+static int bench_recv_uring(int rx, void *ctx)
+{
+	ipmsg_uring *u = ctx;
+	double deadline = bench_now() + BENCH_RECV_WAIT;
+	int n = 0;
+	int got;
+
+	/* completions may trail the sender, collect the burst, but datagrams
+	 * lost on loopback or never sent must not hang the run */
+	while (n < BENCH_DGRAMS && bench_now() < deadline) {
+		if ((got = ipmsg_uring_reap(u, bench_uring_count, NULL)) < 0) {
+			break;
+		}
+		n += got;
+	}
+	return n;
+}
+#endif
+
+typedef void (*bench_sender)(int tx, const struct sockaddr_in *to, void *ctx);
+typedef int (*bench_receiver)(int rx, void *ctx);
+
+static void bench_socket_run(const char *name, bench_sender send, void *send_ctx, bench_receiver recv, void *recv_ctx,
+                             int tx, int rx, const struct sockaddr_in *to)
+{
+	double t_send = 0, t_recv = 0, t;
+	unsigned long got = 0;
+	int i;
+
+	for (i = 0; i < BENCH_ROUNDS; i ++) {
+		t = bench_now();
+		send(tx, to, send_ctx);
+		t_send += bench_now() - t;
+		t = bench_now();
+		got += recv(rx, recv_ctx);
+		t_recv += bench_now() - t;
+	}
+	printf("  %-16s send %6.0f ns/dgram  receive %6.0f ns/dgram  %lu of %lu received\n", name,
+	       t_send * 1e9 / (BENCH_ROUNDS * BENCH_DGRAMS), t_recv * 1e9 / (BENCH_ROUNDS * BENCH_DGRAMS),
+	       got, (unsigned long) BENCH_ROUNDS * BENCH_DGRAMS);
+}
+
+static void bench_sockets(void)
+{
+	struct sockaddr_in txa, rxa;
+	int tx = bench_socket(&txa);
+	int rx = bench_socket(&rxa);
+
+	printf("socket, %d datagrams of %d bytes per burst\n", BENCH_DGRAMS, BENCH_DGRAM_LEN);
+	bench_socket_run("recvmsg", bench_send_sendto, NULL, bench_recv_recvmsg, NULL, tx, rx, &rxa);
+#ifdef MSG_WAITFORONE
+	bench_socket_run("recvmmsg", bench_send_sendto, NULL, bench_recv_recvmmsg, NULL, tx, rx, &rxa);
+#endif
+#ifdef IPMSG_HAVE_IO_URING
+	{
+		/* send-only, the receive belongs to urx */
+		ipmsg_uring *utx = ipmsg_uring_new(tx, 0, 0);
+		ipmsg_uring *urx = ipmsg_uring_new(rx, 512, 4096);
+
+		if (utx != NULL && urx != NULL) {
+			bench_socket_run("io_uring", bench_send_uring, utx, bench_recv_uring, urx, tx, rx, &rxa);
+			printf("  %-16s %lu sends not queued\n", "", bench_uring_send_failed);
+		}
+		else {
+			printf("  %-16s unavailable: %s\n", "io_uring", strerror(errno));
+		}
+		if (utx != NULL) {
+			ipmsg_uring_free(utx);
+		}
+		if (urx != NULL) {
+			ipmsg_uring_free(urx);
+		}
+	}
+#endif
+	close(tx);
+	close(rx);
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t sizes[] = { 64, 1024, 16384 };
+	size_t i;
+
+	for (i = 0; i < G_N_ELEMENTS(sizes); i ++) {
+		bench_utf8("ascii", "hello, world. ", sizes[i]);
+		bench_utf8("mixed", "hi \xe4\xbd\xa0\xe5\xa5\xbd \xe3\x81\x93\xe3\x82\x93 ", sizes[i]);
+		bench_utf8("legacy", "\x82\xb1\x82\xf1\x82\xc9\x82\xbf\x82\xcd", sizes[i]);
+	}
+	bench_sockets();
+	return 0;
+}
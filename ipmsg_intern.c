@@ -0,0 +1,163 @@
+/* vim:ts=4:sw=4:noet
+ */
+#include "ipmsg_intern.h"
+
+#include <string.h>
+
+#define INTERN_CHUNK    16384 /* arena chunk size */
+#define INTERN_ALIGN    8
+#define INTERN_CLASSES  32    /* free lists for entries up to INTERN_CLASSES * INTERN_ALIGN bytes */
+
+typedef struct {
+	guint refs;
+	guint len;
+	char str[1];
+} intern_entry;
+
+#define INTERN_ENTRY(s) ((intern_entry *) ((char *) (s) - G_STRUCT_OFFSET(intern_entry, str)))
+
+struct _ipmsg_intern_pool {
+	GHashTable *strings;                  /* entry->str, hashed by content */
+	GSList *chunks;
+	char *cur;                            /* unused tail of the newest chunk */
+	size_t left;
+	intern_entry *free[INTERN_CLASSES];   /* released entries by size, linked through str */
+	ipmsg_intern_stats stats;
+};
+
+static size_t intern_size(size_t len)
+{
+	size_t size = G_STRUCT_OFFSET(intern_entry, str) + len + 1;
+	return (size + INTERN_ALIGN - 1) & ~(size_t) (INTERN_ALIGN - 1);
+}
+
+static intern_entry *intern_alloc(ipmsg_intern_pool *pool, size_t size)
+{
+	unsigned int cls = size / INTERN_ALIGN - 1;
+	intern_entry *e;
+
+	if (cls >= INTERN_CLASSES) {
+		pool->stats.arena += size;
+		return g_malloc(size);
+	}
+	if ((e = pool->free[cls]) != NULL) {
+		memcpy(&pool->free[cls], e->str, sizeof(e));
+		return e;
+	}
+	if (pool->left < size) {
+		/* the old tail is too short to matter */
+		pool->cur = g_malloc(INTERN_CHUNK);
+		pool->left = INTERN_CHUNK;
+		pool->chunks = g_slist_prepend(pool->chunks, pool->cur);
+		pool->stats.arena += INTERN_CHUNK;
+	}
+	e = (intern_entry *) pool->cur;
+	pool->cur += size;
+	pool->left -= size;
+	return e;
+}
+
+static void intern_release(ipmsg_intern_pool *pool, intern_entry *e)
+{
+	size_t size = intern_size(e->len);
+	unsigned int cls = size / INTERN_ALIGN - 1;
+
+	if (cls >= INTERN_CLASSES) {
+		pool->stats.arena -= size;
+		g_free(e);
+		return;
+	}
+	memcpy(e->str, &pool->free[cls], sizeof(e));
+	pool->free[cls] = e;
+}
+
+ipmsg_intern_pool *ipmsg_intern_new(void)
+{
+	ipmsg_intern_pool *pool = g_new0(ipmsg_intern_pool, 1);
+
+	pool->strings = g_hash_table_new(g_str_hash, g_str_equal);
+	return pool;
+}
+
+static void intern_free_large(gpointer key, gpointer value, gpointer data)
+{
+	intern_entry *e = INTERN_ENTRY(key);
+
+	if (intern_size(e->len) / INTERN_ALIGN - 1 >= INTERN_CLASSES) {
+		g_free(e);
+	}
+}
+
+void ipmsg_intern_free(ipmsg_intern_pool *pool)
+{
+	g_hash_table_foreach(pool->strings, intern_free_large, NULL);
+	g_hash_table_destroy(pool->strings);
+	while (pool->chunks != NULL) {
+		g_free(pool->chunks->data);
+		pool->chunks = g_slist_delete_link(pool->chunks, pool->chunks);
+	}
+	g_free(pool);
+}
+
+const char *ipmsg_intern(ipmsg_intern_pool *pool, const char *str)
+{
+	const char *istr = g_hash_table_lookup(pool->strings, str);
+	intern_entry *e;
+	size_t len;
+
+	if (istr != NULL) {
+		return ipmsg_intern_ref(pool, istr);
+	}
+
+	len = strlen(str);
+	e = intern_alloc(pool, intern_size(len));
+	e->refs = 1;
+	e->len = len;
+	memcpy(e->str, str, len + 1);
+	g_hash_table_insert(pool->strings, e->str, e->str);
+
+	pool->stats.strings ++;
+	pool->stats.refs ++;
+	pool->stats.bytes += len + 1;
+	return e->str;
+}
+
+const char *ipmsg_intern_ref(ipmsg_intern_pool *pool, const char *istr)
+{
+	intern_entry *e = INTERN_ENTRY(istr);
+
+	e->refs ++;
+	pool->stats.refs ++;
+	pool->stats.saved += e->len + 1;
+	return istr;
+}
+
+void ipmsg_intern_unref(ipmsg_intern_pool *pool, const char *istr)
+{
+	intern_entry *e;
+
+	if (istr == NULL) {
+		return;
+	}
+	e = INTERN_ENTRY(istr);
+	pool->stats.refs --;
+	if (-- e->refs > 0) {
+		pool->stats.saved -= e->len + 1;
+		return;
+	}
+
+	g_hash_table_remove(pool->strings, e->str);
+	pool->stats.strings --;
+	pool->stats.bytes -= e->len + 1;
+	intern_release(pool, e);
+}
+
+const char *ipmsg_intern_peek(ipmsg_intern_pool *pool, const char *str)
+{
+	return g_hash_table_lookup(pool->strings, str);
+}
+
+void ipmsg_intern_get_stats(const ipmsg_intern_pool *pool, ipmsg_intern_stats *stats)
+{
+	*stats = pool->stats;
+}
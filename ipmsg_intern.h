@@ -0,0 +1,34 @@
+/* vim:ts=4:sw=4:noet
+ */
+#ifndef IPMSG_INTERN_H
+#define IPMSG_INTERN_H
+
+#include <glib.h>
+
+/* hash-consed, refcounted copies of the user and host names that repeat
+ * across peers and records; equal strings from one pool share a pointer,
+ * so interned names compare with == */
+typedef struct _ipmsg_intern_pool ipmsg_intern_pool;
+
+typedef struct {
+	unsigned int strings;   /* distinct strings */
+	unsigned long refs;     /* references handed out */
+	unsigned long bytes;    /* string bytes held, NULs included */
+	unsigned long arena;    /* bytes reserved from malloc */
+	unsigned long saved;    /* bytes one private copy per reference would add */
+} ipmsg_intern_stats;
+
+ipmsg_intern_pool *ipmsg_intern_new(void);
+void ipmsg_intern_free(ipmsg_intern_pool *pool);
+
+/* the pooled copy of str, with a new reference */
+const char *ipmsg_intern(ipmsg_intern_pool *pool, const char *str);
+const char *ipmsg_intern_ref(ipmsg_intern_pool *pool, const char *istr);
+void ipmsg_intern_unref(ipmsg_intern_pool *pool, const char *istr);
+
+/* the pooled copy of str without taking a reference, NULL if there is none */
+const char *ipmsg_intern_peek(ipmsg_intern_pool *pool, const char *str);
+
+void ipmsg_intern_get_stats(const ipmsg_intern_pool *pool, ipmsg_intern_stats *stats);
+
+#endif /* IPMSG_INTERN_H */
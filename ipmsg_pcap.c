@@ -0,0 +1,162 @@
+/* vim:ts=4:sw=4:noet
+ */
+#include "ipmsg_pcap.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define PCAP_MAGIC         0xa1b2c3d4
+#define PCAP_VERSION_MAJOR 2
+#define PCAP_VERSION_MINOR 4
+#define PCAP_LINKTYPE_RAW  101 /* packets start with the IP header */
+
+#define IPV4_HDRLEN 20
+#define UDP_HDRLEN  8
+
+typedef struct {
+	struct timeval ts;
+	struct sockaddr_in peer;
+	guint32 len;      /* length on the wire */
+	gboolean outgoing;
+} ipmsg_capture_rec;
+
+struct _ipmsg_capture {
+	unsigned int slots;
+	unsigned int snaplen;
+	unsigned int next;  /* slot the next datagram goes to */
+	unsigned int count; /* filled slots, up to slots */
+	ipmsg_capture_rec *recs;
+	char *data;         /* slots * snaplen payload bytes */
+};
+
+ipmsg_capture *ipmsg_capture_new(unsigned int slots, unsigned int snaplen)
+{
+	ipmsg_capture *cap = g_new0(ipmsg_capture, 1);
+
+	cap->slots = slots;
+	cap->snaplen = snaplen;
+	cap->recs = g_new0(ipmsg_capture_rec, slots);
+	cap->data = g_malloc((gsize) slots * snaplen);
+	return cap;
+}
+
+void ipmsg_capture_free(ipmsg_capture *cap)
+{
+	g_free(cap->recs);
+	g_free(cap->data);
+	g_free(cap);
+}
+
+unsigned int ipmsg_capture_count(const ipmsg_capture *cap)
+{
+	return cap->count;
+}
+
+void ipmsg_capture_add(ipmsg_capture *cap, gboolean outgoing, const struct sockaddr_in *peer,
+                       const void *data, size_t len)
+{
+	ipmsg_capture_rec *rec = &cap->recs[cap->next];
+
+	gettimeofday(&rec->ts, NULL);
+	rec->peer = *peer;
+	rec->len = len;
+	rec->outgoing = outgoing;
+	memcpy(cap->data + (size_t) cap->next * cap->snaplen, data, MIN(len, cap->snaplen));
+
+	if (++ cap->next == cap->slots) {
+		cap->next = 0;
+	}
+	if (cap->count < cap->slots) {
+		cap->count ++;
+	}
+}
+
+static guint16 ipmsg_capture_ip_checksum(const guchar *hdr)
+{
+	guint32 sum = 0;
+	int i;
+
+	for (i = 0; i < IPV4_HDRLEN; i += 2) {
+		sum += (hdr[i] << 8) | hdr[i + 1];
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum & 0xffff;
+}
+
+static void ipmsg_capture_headers(guchar *hdr, const struct sockaddr_in *src, const struct sockaddr_in *dst, guint32 len)
+{
+	guint16 total = MIN(len + IPV4_HDRLEN + UDP_HDRLEN, 0xffff);
+	guint16 udplen = MIN(len + UDP_HDRLEN, 0xffff);
+	guint16 sum;
+
+	memset(hdr, 0, IPV4_HDRLEN + UDP_HDRLEN);
+	hdr[0] = 0x45; /* v4, 5 words */
+	hdr[2] = total >> 8;
+	hdr[3] = total & 0xff;
+	hdr[8] = 64;   /* ttl */
+	hdr[9] = IPPROTO_UDP;
+	memcpy(hdr + 12, &src->sin_addr, 4);
+	memcpy(hdr + 16, &dst->sin_addr, 4);
+	sum = ipmsg_capture_ip_checksum(hdr);
+	hdr[10] = sum >> 8;
+	hdr[11] = sum & 0xff;
+
+	/* udp, checksum 0 means none */
+	memcpy(hdr + IPV4_HDRLEN, &src->sin_port, 2);
+	memcpy(hdr + IPV4_HDRLEN + 2, &dst->sin_port, 2);
+	hdr[IPV4_HDRLEN + 4] = udplen >> 8;
+	hdr[IPV4_HDRLEN + 5] = udplen & 0xff;
+}
+
+gboolean ipmsg_capture_dump(const ipmsg_capture *cap, const struct sockaddr_in *local, const char *filename)
+{
+	guint32 ghdr[6];
+	FILE *fp;
+	unsigned int i, slot;
+
+	if ((fp = fopen(filename, "wb")) == NULL) {
+		return FALSE;
+	}
+
+	ghdr[0] = PCAP_MAGIC;
+	ghdr[1] = PCAP_VERSION_MAJOR | (PCAP_VERSION_MINOR << 16);
+	ghdr[2] = 0; /* thiszone */
+	ghdr[3] = 0; /* sigfigs */
+	ghdr[4] = cap->snaplen + IPV4_HDRLEN + UDP_HDRLEN;
+	ghdr[5] = PCAP_LINKTYPE_RAW;
+	fwrite(ghdr, sizeof(ghdr), 1, fp);
+
+	/* oldest first */
+	slot = (cap->next + cap->slots - cap->count) % cap->slots;
+	for (i = 0; i < cap->count; i ++, slot = (slot + 1) % cap->slots) {
+		const ipmsg_capture_rec *rec = &cap->recs[slot];
+		guchar hdr[IPV4_HDRLEN + UDP_HDRLEN];
+		guint32 rhdr[4];
+		guint32 caplen = MIN(rec->len, cap->snaplen);
+
+		if (rec->outgoing) {
+			ipmsg_capture_headers(hdr, local, &rec->peer, rec->len);
+		}
+		else {
+			ipmsg_capture_headers(hdr, &rec->peer, local, rec->len);
+		}
+
+		rhdr[0] = rec->ts.tv_sec;
+		rhdr[1] = rec->ts.tv_usec;
+		rhdr[2] = caplen + sizeof(hdr);
+		rhdr[3] = rec->len + sizeof(hdr);
+		fwrite(rhdr, sizeof(rhdr), 1, fp);
+		fwrite(hdr, sizeof(hdr), 1, fp);
+		fwrite(cap->data + (size_t) slot * cap->snaplen, caplen, 1, fp);
+	}
+
+	if (ferror(fp)) {
+		fclose(fp);
+		return FALSE;
+	}
+	return fclose(fp) == 0;
+}
@@ -0,0 +1,25 @@
+/* vim:ts=4:sw=4:noet
+ */
+#ifndef IPMSG_PCAP_H
+#define IPMSG_PCAP_H
+
+#include <glib.h>
+#include <netinet/in.h>
+
+/* fixed size ring of the most recent datagrams, written out as pcap with
+ * synthesized IPv4/UDP headers so the dump opens in any capture tool */
+typedef struct _ipmsg_capture ipmsg_capture;
+
+ipmsg_capture *ipmsg_capture_new(unsigned int slots, unsigned int snaplen);
+void ipmsg_capture_free(ipmsg_capture *cap);
+
+/* one memcpy of at most snaplen bytes, oldest datagram is overwritten */
+void ipmsg_capture_add(ipmsg_capture *cap, gboolean outgoing, const struct sockaddr_in *peer,
+                       const void *data, size_t len);
+
+/* local is our end of every captured datagram; returns FALSE with errno set */
+gboolean ipmsg_capture_dump(const ipmsg_capture *cap, const struct sockaddr_in *local, const char *filename);
+
+unsigned int ipmsg_capture_count(const ipmsg_capture *cap);
+
+#endif /* IPMSG_PCAP_H */
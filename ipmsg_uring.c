@@ -0,0 +1,302 @@
+/* vim:ts=4:sw=4:noet
+ */
+#include "ipmsg_uring.h"
+
+#include <liburing.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <netinet/ip.h>
+
+#define URING_ENTRIES 256
+#define URING_BGID    0  /* provided buffer group of the receive */
+
+typedef struct {
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_in to;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	char data[1];
+} uring_send;
+
+struct _ipmsg_uring {
+	struct io_uring ring;
+	struct io_uring_buf_ring *br;
+	unsigned int nbufs;
+	unsigned int bufsize;
+	char *bufs;
+	struct msghdr recv_msg;  /* only namelen and controllen matter to multishot */
+	int fd;
+	int efd;
+	unsigned int queued;     /* SQEs not yet submitted */
+	unsigned int inflight;   /* sends not yet completed */
+	ipmsg_uring_stats stats;
+};
+
+static struct io_uring_sqe *uring_get_sqe(ipmsg_uring *u)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&u->ring);
+
+	if (sqe == NULL) {
+		/* submission queue full, make room */
+		ipmsg_uring_submit(u);
+		sqe = io_uring_get_sqe(&u->ring);
+	}
+	return sqe;
+}
+
+static gboolean uring_arm_recv(ipmsg_uring *u)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+	if (sqe == NULL) {
+		return FALSE;
+	}
+	io_uring_prep_recvmsg_multishot(sqe, u->fd, &u->recv_msg, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data(sqe, NULL);
+	u->queued ++;
+	return TRUE;
+}
+
+ipmsg_uring *ipmsg_uring_new(int fd, unsigned int bufs, unsigned int bufsize)
+{
+	ipmsg_uring *u = g_new0(ipmsg_uring, 1);
+	unsigned int i;
+	int mask;
+	int ret;
+
+	u->fd = fd;
+	u->efd = -1;
+	u->nbufs = bufs;
+	u->bufsize = bufsize;
+	u->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+	u->recv_msg.msg_controllen = CMSG_SPACE(sizeof(struct timespec));
+
+	if ((ret = io_uring_queue_init(URING_ENTRIES, &u->ring, 0)) < 0) {
+		g_free(u);
+		errno = -ret;
+		return NULL;
+	}
+	if (bufs > 0) {
+		if ((u->br = io_uring_setup_buf_ring(&u->ring, bufs, URING_BGID, 0, &ret)) == NULL) {
+			io_uring_queue_exit(&u->ring);
+			g_free(u);
+			errno = -ret;
+			return NULL;
+		}
+
+		u->bufs = g_malloc((gsize) bufs * bufsize);
+		mask = io_uring_buf_ring_mask(bufs);
+		for (i = 0; i < bufs; i ++) {
+			io_uring_buf_ring_add(u->br, u->bufs + (gsize) i * bufsize, bufsize, i, mask, i);
+		}
+		io_uring_buf_ring_advance(u->br, bufs);
+	}
+
+	ret = 0;
+	if ((u->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 ||
+	    (ret = io_uring_register_eventfd(&u->ring, u->efd)) < 0 ||
+	    (bufs > 0 && !uring_arm_recv(u))) {
+		int saved = u->efd < 0 ? errno : ret < 0 ? -ret : EBUSY;
+		ipmsg_uring_free(u);
+		errno = saved;
+		return NULL;
+	}
+	ipmsg_uring_submit(u);
+	return u;
+}
+
+void ipmsg_uring_free(ipmsg_uring *u)
+{
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+
+	/* queued sends still get their chance, most complete inline on submit */
+	ipmsg_uring_submit(u);
+	/* the rest are cancelled, never waited for: this runs on the main loop */
+	if ((sqe = io_uring_get_sqe(&u->ring)) != NULL) {
+		io_uring_prep_cancel(sqe, NULL, IORING_ASYNC_CANCEL_ANY);
+		io_uring_sqe_set_data(sqe, u);
+		io_uring_submit(&u->ring);
+	}
+	while (io_uring_peek_cqe(&u->ring, &cqe) == 0) {
+		uring_send *snd = io_uring_cqe_get_data(cqe);
+		if (snd != NULL && snd != (uring_send *) u) {
+			g_free(snd);
+			u->inflight --;
+		}
+		io_uring_cqe_seen(&u->ring, cqe);
+	}
+	if (u->inflight > 0) {
+		/* the kernel may still read them, a few bytes are leaked instead */
+		g_warning("ipmsg_uring_free: %u sends still in flight", u->inflight);
+	}
+
+	if (u->br != NULL) {
+		io_uring_free_buf_ring(&u->ring, u->br, u->nbufs, URING_BGID);
+	}
+	/* tears down the multishot receive too */
+	io_uring_queue_exit(&u->ring);
+	g_free(u->bufs);
+	if (u->efd >= 0) {
+		close(u->efd);
+	}
+	g_free(u);
+}
+
+int ipmsg_uring_eventfd(const ipmsg_uring *u)
+{
+	return u->efd;
+}
+
+/* SCM_TIMESTAMPNS out of a multishot receive buffer */
+static gboolean uring_stamp(struct io_uring_recvmsg_out *out, struct msghdr *msg, struct timespec *stamp)
+{
+	struct cmsghdr *cmsg;
+
+	for (cmsg = io_uring_recvmsg_cmsg_firsthdr(out, msg); cmsg != NULL;
+	     cmsg = io_uring_recvmsg_cmsg_nexthdr(out, msg, cmsg)) {
+#ifdef SO_TIMESTAMPNS
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			memcpy(stamp, CMSG_DATA(cmsg), sizeof(*stamp));
+			return TRUE;
+		}
+#endif
+	}
+	return FALSE;
+}
+
+int ipmsg_uring_reap(ipmsg_uring *u, ipmsg_uring_recv_func func, gpointer data)
+{
+	struct io_uring_cqe *cqe;
+	unsigned int head;
+	unsigned int seen = 0;
+	int recycled = 0;
+	int handled = 0;
+	int failed = 0;
+	gboolean rearm = FALSE;
+	int mask = u->nbufs > 0 ? io_uring_buf_ring_mask(u->nbufs) : 0;
+	eventfd_t ev;
+
+	eventfd_read(u->efd, &ev);
+
+	io_uring_for_each_cqe(&u->ring, head, cqe) {
+		uring_send *snd = io_uring_cqe_get_data(cqe);
+		struct io_uring_recvmsg_out *out;
+		struct timespec stamp;
+		unsigned short bid;
+		char *buf;
+
+		seen ++;
+		if (snd != NULL) {
+			if (cqe->res < 0) {
+				u->stats.send_errors ++;
+			}
+			u->inflight --;
+			g_free(snd);
+			continue;
+		}
+
+		if (!(cqe->flags & IORING_CQE_F_MORE)) {
+			rearm = TRUE;
+		}
+		if (cqe->res < 0) {
+			if (cqe->res == -ENOBUFS) {
+				/* re-armed below once buffers are back */
+				u->stats.nobufs ++;
+			}
+			else if (cqe->res != -EINTR) {
+				failed = -cqe->res;
+			}
+			continue;
+		}
+		if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+			continue;
+		}
+
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = u->bufs + (gsize) bid * u->bufsize;
+		out = io_uring_recvmsg_validate(buf, cqe->res, &u->recv_msg);
+		if (out != NULL && out->namelen >= sizeof(struct sockaddr_in)) {
+			if (out->flags & MSG_TRUNC) {
+				u->stats.truncated ++;
+			}
+			func(io_uring_recvmsg_name(out), io_uring_recvmsg_payload(out, &u->recv_msg),
+			     io_uring_recvmsg_payload_length(out, cqe->res, &u->recv_msg),
+			     uring_stamp(out, &u->recv_msg, &stamp) ? &stamp : NULL, data);
+			u->stats.received ++;
+			handled ++;
+		}
+		io_uring_buf_ring_add(u->br, buf, u->bufsize, bid, mask, recycled);
+		recycled ++;
+	}
+	if (recycled > 0) {
+		io_uring_buf_ring_advance(u->br, recycled);
+	}
+	io_uring_cq_advance(&u->ring, seen);
+
+	/* re-armed even on an error, or the socket goes deaf for good */
+	if (rearm && uring_arm_recv(u)) {
+		u->stats.rearms ++;
+	}
+	ipmsg_uring_submit(u);
+	if (failed != 0) {
+		errno = failed;
+		return -1;
+	}
+	return handled;
+}
+
+gboolean ipmsg_uring_sendto(ipmsg_uring *u, int tos, const struct sockaddr_in *to, const void *data, size_t len)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe(u);
+	struct cmsghdr *cmsg;
+	uring_send *snd;
+
+	if (sqe == NULL) {
+		errno = ENOBUFS;
+		return FALSE;
+	}
+
+	snd = g_malloc0(G_STRUCT_OFFSET(uring_send, data) + len);
+	memcpy(snd->data, data, len);
+	snd->to = *to;
+	snd->iov.iov_base = snd->data;
+	snd->iov.iov_len = len;
+	snd->msg.msg_name = &snd->to;
+	snd->msg.msg_namelen = sizeof(snd->to);
+	snd->msg.msg_iov = &snd->iov;
+	snd->msg.msg_iovlen = 1;
+	/* the lanes' TOS travels with each datagram, as sends complete asynchronously */
+	snd->msg.msg_control = snd->cbuf;
+	snd->msg.msg_controllen = sizeof(snd->cbuf);
+	cmsg = CMSG_FIRSTHDR(&snd->msg);
+	cmsg->cmsg_level = IPPROTO_IP;
+	cmsg->cmsg_type = IP_TOS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &tos, sizeof(int));
+
+	io_uring_prep_sendmsg(sqe, u->fd, &snd->msg, 0);
+	io_uring_sqe_set_data(sqe, snd);
+	u->queued ++;
+	u->inflight ++;
+	u->stats.sends ++;
+	return TRUE;
+}
+
+void ipmsg_uring_submit(ipmsg_uring *u)
+{
+	if (u->queued > 0) {
+		io_uring_submit(&u->ring);
+		u->queued = 0;
+		u->stats.submits ++;
+	}
+}
+
+void ipmsg_uring_get_stats(const ipmsg_uring *u, ipmsg_uring_stats *stats)
+{
+	*stats = u->stats;
+}
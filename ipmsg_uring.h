@@ -0,0 +1,51 @@
+/* vim:ts=4:sw=4:noet
+ */
+#ifndef IPMSG_URING_H
+#define IPMSG_URING_H
+
+#include <glib.h>
+#include <time.h>
+#include <netinet/in.h>
+
+/* io_uring backend for the IPMsg UDP socket, built when CMake finds liburing
+ * (IPMSG_HAVE_IO_URING). One multishot recvmsg is fed from a provided buffer
+ * ring, and sends are queued as SQEs and submitted once per batch. */
+typedef struct _ipmsg_uring ipmsg_uring;
+
+typedef struct {
+	unsigned long received;
+	unsigned long truncated;
+	unsigned long rearms;     /* multishot receive had to be submitted again */
+	unsigned long nobufs;     /* the buffer ring ran dry */
+	unsigned long sends;
+	unsigned long send_errors;
+	unsigned long submits;    /* io_uring_submit() calls that carried SQEs */
+} ipmsg_uring_stats;
+
+/* stamp is the SO_TIMESTAMPNS receive time, NULL if the datagram had none */
+typedef void (*ipmsg_uring_recv_func)(const struct sockaddr_in *from, const char *buf, size_t len,
+                                      const struct timespec *stamp, gpointer data);
+
+/* bufs must be a power of two, or 0 for a send-only ring with no receive
+ * armed; bufsize covers the payload plus the address and control headers.
+ * NULL with errno set when the kernel cannot do it. */
+ipmsg_uring *ipmsg_uring_new(int fd, unsigned int bufs, unsigned int bufsize);
+
+/* submits what is queued and cancels the sends still in flight, without
+ * blocking */
+void ipmsg_uring_free(ipmsg_uring *u);
+
+/* readable while completions are waiting */
+int ipmsg_uring_eventfd(const ipmsg_uring *u);
+
+/* hands every received datagram to func; returns how many, or -1 with errno
+ * set if receiving failed for good, e.g. multishot recvmsg is unsupported */
+int ipmsg_uring_reap(ipmsg_uring *u, ipmsg_uring_recv_func func, gpointer data);
+
+/* queues a copy of data marked with tos; nothing goes out before submit */
+gboolean ipmsg_uring_sendto(ipmsg_uring *u, int tos, const struct sockaddr_in *to, const void *data, size_t len);
+void ipmsg_uring_submit(ipmsg_uring *u);
+
+void ipmsg_uring_get_stats(const ipmsg_uring *u, ipmsg_uring_stats *stats);
+
+#endif /* IPMSG_URING_H */
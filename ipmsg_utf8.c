@@ -0,0 +1,306 @@
+/* vim:ts=4:sw=4:noet
+ */
+/* UTF-8 validation for received message bodies.
+ *
+ * The AVX2 kernel is the table lookup algorithm of Keiser and Lemire
+ * ("Validating UTF-8 In Less Than One Instruction Per Byte"): every error
+ * class is decided from the high nibble of the previous byte, its low nibble
+ * and the high nibble of the current byte, 32 bytes at a time. The SSE2
+ * kernel lacks a byte shuffle, so it only skips ASCII runs 16 bytes at a
+ * time and hands everything else to the scalar decoder.
+ */
+#include "ipmsg_utf8.h"
+
+#include <string.h>
+
+#ifdef IPMSG_UTF8_X86
+#include <immintrin.h>
+#endif
+
+/* length of the well formed sequence at p, 0 if there is none */
+static size_t ipmsg_utf8_seq(const guchar *p, const guchar *end)
+{
+	guchar c = p[0];
+
+	if (c < 0x80) {
+		return c != 0 ? 1 : 0;
+	}
+	if (c < 0xc2) {
+		return 0;
+	}
+	if (c < 0xe0) {
+		if (end - p < 2 || (p[1] & 0xc0) != 0x80) {
+			return 0;
+		}
+		return 2;
+	}
+	if (c < 0xf0) {
+		if (end - p < 3 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80) {
+			return 0;
+		}
+		if ((c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] > 0x9f)) {
+			return 0;
+		}
+		return 3;
+	}
+	if (c < 0xf5) {
+		if (end - p < 4 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80) {
+			return 0;
+		}
+		if ((c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] > 0x8f)) {
+			return 0;
+		}
+		return 4;
+	}
+	return 0;
+}
+
+gboolean ipmsg_utf8_validate_scalar(const char *buf, size_t len)
+{
+	const guchar *p = (const guchar *) buf;
+	const guchar *end = p + len;
+	size_t n;
+
+	while (p < end) {
+		if ((n = ipmsg_utf8_seq(p, end)) == 0) {
+			return FALSE;
+		}
+		p += n;
+	}
+	return TRUE;
+}
+
+#ifdef IPMSG_UTF8_X86
+__attribute__((target("sse2")))
+gboolean ipmsg_utf8_validate_sse2(const char *buf, size_t len)
+{
+	const guchar *p = (const guchar *) buf;
+	const guchar *end = p + len;
+	const __m128i zero = _mm_setzero_si128();
+	size_t n;
+
+	while (p < end) {
+		if (end - p >= 16) {
+			__m128i in = _mm_loadu_si128((const __m128i *) p);
+			if (_mm_movemask_epi8(_mm_or_si128(in, _mm_cmpeq_epi8(in, zero))) == 0) {
+				p += 16;
+				continue;
+			}
+		}
+
+		/* decode at least up to the end of this block, sequences may straddle it */
+		{
+			const guchar *stop = MIN(p + 16, end);
+			while (p < stop) {
+				if ((n = ipmsg_utf8_seq(p, end)) == 0) {
+					return FALSE;
+				}
+				p += n;
+			}
+		}
+	}
+	return TRUE;
+}
+
+/* error classes, see Keiser and Lemire, table 8 */
+#define U8_TOO_SHORT   (1 << 0)
+#define U8_TOO_LONG    (1 << 1)
+#define U8_OVERLONG_3  (1 << 2)
+#define U8_TOO_LARGE   (1 << 3)
+#define U8_SURROGATE   (1 << 4)
+#define U8_OVERLONG_2  (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4  (1 << 6)
+#define U8_TWO_CONTS   (1 << 7)
+#define U8_CARRY       (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+#define U8_LOOKUP(a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15) \
+	_mm256_setr_epi8(a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15, \
+	                 a0, a1, a2, a3, a4, a5, a6, a7, a8, a9, a10, a11, a12, a13, a14, a15)
+
+__attribute__((target("avx2")))
+static inline __m256i ipmsg_utf8_prev(__m256i in, __m256i prev_in, int n)
+{
+	__m256i joined = _mm256_permute2x128_si256(prev_in, in, 0x21);
+
+	switch (n) {
+	case 1: return _mm256_alignr_epi8(in, joined, 15);
+	case 2: return _mm256_alignr_epi8(in, joined, 14);
+	default: return _mm256_alignr_epi8(in, joined, 13);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ipmsg_utf8_check_block(__m256i in, __m256i prev_in)
+{
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	const __m256i byte_1_high_tbl = U8_LOOKUP(
+		/* 0_______ ________ ASCII in byte 1 */
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+		/* 10______ ________ continuation in byte 1 */
+		U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+		/* 1100____ ________ two byte lead */
+		U8_TOO_SHORT | U8_OVERLONG_2,
+		/* 1101____ ________ two byte lead */
+		U8_TOO_SHORT,
+		/* 1110____ ________ three byte lead */
+		U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+		/* 1111____ ________ four byte lead */
+		U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4);
+	const __m256i byte_1_low_tbl = U8_LOOKUP(
+		/* ____0000 ________ */
+		U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+		/* ____0001 ________ */
+		U8_CARRY | U8_OVERLONG_2,
+		/* ____001_ ________ */
+		U8_CARRY,
+		U8_CARRY,
+		/* ____0100 ________ */
+		U8_CARRY | U8_TOO_LARGE,
+		/* ____0101 ________ and up */
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		/* ____1101 ________ */
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+		U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000);
+	const __m256i byte_2_high_tbl = U8_LOOKUP(
+		/* ________ 0_______ ASCII in byte 2 */
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+		/* ________ 1000____ */
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+		/* ________ 1001____ */
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+		/* ________ 101_____ */
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+		U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+		/* ________ 11______ */
+		U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+
+	__m256i prev1 = ipmsg_utf8_prev(in, prev_in, 1);
+	__m256i prev2 = ipmsg_utf8_prev(in, prev_in, 2);
+	__m256i prev3 = ipmsg_utf8_prev(in, prev_in, 3);
+	__m256i special, third, fourth, must23;
+
+	special = _mm256_and_si256(
+		_mm256_and_si256(
+			_mm256_shuffle_epi8(byte_1_high_tbl, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+			_mm256_shuffle_epi8(byte_1_low_tbl, _mm256_and_si256(prev1, nibble))),
+		_mm256_shuffle_epi8(byte_2_high_tbl, _mm256_and_si256(_mm256_srli_epi16(in, 4), nibble)));
+
+	/* only 111_____ and 1111____ leads reach 0x80 after the subtraction */
+	third = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char) (0xe0 - 0x80)));
+	fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char) (0xf0 - 0x80)));
+	must23 = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char) 0x80));
+
+	return _mm256_xor_si256(must23, special);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i ipmsg_utf8_incomplete(__m256i in)
+{
+	/* a lead byte in the last three positions still wants continuations */
+	const __m256i max = _mm256_setr_epi8(
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		(char) (0xf0 - 1), (char) (0xe0 - 1), (char) (0xc0 - 1));
+	return _mm256_subs_epu8(in, max);
+}
+
+__attribute__((target("avx2")))
+gboolean ipmsg_utf8_validate_avx2(const char *buf, size_t len)
+{
+	const guchar *p = (const guchar *) buf;
+	const guchar *end = p + len;
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i error = zero;
+	__m256i prev_in = zero;
+	__m256i prev_incomplete = zero;
+	__m256i in;
+	guchar tail[32];
+
+	for (;;) {
+		if (end - p >= 32) {
+			in = _mm256_loadu_si256((const __m256i *) p);
+			error = _mm256_or_si256(error, _mm256_cmpeq_epi8(in, zero));
+			p += 32;
+		}
+		else if (p < end) {
+			/* zero padding reads as ASCII, so a truncated tail shows up as TOO_SHORT */
+			if (memchr(p, '\0', end - p) != NULL) {
+				return FALSE;
+			}
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, p, end - p);
+			in = _mm256_loadu_si256((const __m256i *) tail);
+			p = end;
+		}
+		else {
+			break;
+		}
+
+		if (_mm256_movemask_epi8(in) == 0) {
+			error = _mm256_or_si256(error, prev_incomplete);
+			prev_incomplete = zero;
+		}
+		else {
+			error = _mm256_or_si256(error, ipmsg_utf8_check_block(in, prev_in));
+			prev_incomplete = ipmsg_utf8_incomplete(in);
+		}
+		prev_in = in;
+	}
+
+	error = _mm256_or_si256(error, prev_incomplete);
+	return _mm256_testz_si256(error, error);
+}
+#endif /* IPMSG_UTF8_X86 */
+
+typedef gboolean (*ipmsg_utf8_kernel)(const char *buf, size_t len);
+
+gboolean ipmsg_utf8_validate(const char *buf, size_t len)
+{
+	static ipmsg_utf8_kernel kernel = NULL;
+
+	if (kernel == NULL) {
+#ifdef IPMSG_UTF8_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2")) {
+			kernel = ipmsg_utf8_validate_avx2;
+		}
+		else if (__builtin_cpu_supports("sse2")) {
+			kernel = ipmsg_utf8_validate_sse2;
+		}
+		else
+#endif
+		kernel = ipmsg_utf8_validate_scalar;
+	}
+	return kernel(buf, len);
+}
+
+char *ipmsg_utf8_make_valid(const char *buf, size_t len)
+{
+	const guchar *p = (const guchar *) buf;
+	const guchar *end = p + len;
+	GString *str = g_string_sized_new(len + 1);
+	size_t n;
+
+	while (p < end) {
+		if ((n = ipmsg_utf8_seq(p, end)) == 0) {
+			g_string_append_c(str, '?');
+			n = 1;
+		}
+		else {
+			g_string_append_len(str, (const char *) p, n);
+		}
+		p += n;
+	}
+	return g_string_free(str, FALSE);
+}
@@ -0,0 +1,23 @@
+/* vim:ts=4:sw=4:noet
+ */
+#ifndef IPMSG_UTF8_H
+#define IPMSG_UTF8_H
+
+#include <glib.h>
+
+/* TRUE if buf[0..len) is well formed UTF-8 without embedded NULs.
+ * Picks the AVX2, SSE2 or scalar kernel once, on first use. */
+gboolean ipmsg_utf8_validate(const char *buf, size_t len);
+
+/* the individual kernels, exported for the benchmark */
+gboolean ipmsg_utf8_validate_scalar(const char *buf, size_t len);
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IPMSG_UTF8_X86 1
+gboolean ipmsg_utf8_validate_sse2(const char *buf, size_t len);
+gboolean ipmsg_utf8_validate_avx2(const char *buf, size_t len);
+#endif
+
+/* copy of buf[0..len) with every malformed sequence replaced by '?' */
+char *ipmsg_utf8_make_valid(const char *buf, size_t len);
+
+#endif /* IPMSG_UTF8_H */
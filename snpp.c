@@ -32,15 +32,19 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <glib.h>
 #include <string.h>
 #ifndef _WIN32
 #include <sys/socket.h>
+#include <sys/uio.h>
 #else
 #include <libc_interface.h>
 #endif
 #include <sys/types.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include <plugin.h>
 #include <accountopt.h>
@@ -60,322 +64,1767 @@
 
 #define SNPP_INITIAL_BUFSIZE 1024
 
+/* Longest reply we buffer waiting for its end of line */
+#define SNPP_MAX_REPLY 65536
+
+/* Commands handed to one writev() */
+#define SNPP_MAX_IOV 64
+
+/* Longer messages, and any with line breaks, go out with DATA instead of MESS */
+#define SNPP_MESS_MAX 256
+
+/* Seconds a logged in session stays open waiting for the next page */
+#define SNPP_DEFAULT_IDLE_TIMEOUT 60
+
+/* Pages handed to sessions and not answered yet, across all sessions */
+#define SNPP_DEFAULT_MAX_INFLIGHT 8
+
+/* PAGE commands ahead of one MESS/SEND when identical pages are merged */
+#define SNPP_MAX_RECIPIENTS 64
+
+/*
+ * Failures in a row before a server's breaker opens, and how long it stays
+ * open before a health check may close it again; doubled on each failed
+ * check up to the maximum.
+ */
+#define SNPP_BREAKER_THRESHOLD 3
+#define SNPP_BREAKER_COOLDOWN 15
+#define SNPP_BREAKER_MAX_COOLDOWN 300
+
+/* Seconds a server is left alone after its session was reset, whatever the cause */
+#define SNPP_RECONNECT_DELAY 2
+
+/* Outbox records appended within this many milliseconds share one fsync() */
+#define SNPP_OUTBOX_SYNC_MS 100
+#define SNPP_RETRY_BASE 10
+#define SNPP_RETRY_MAX_DELAY 900
+#define SNPP_RETRY_MAX_ATTEMPTS 8
+
+enum breaker {
+	BREAKER_CLOSED,			/* pages are routed here */
+	BREAKER_OPEN,			/* failing, left alone until retry_at */
+	BREAKER_PROBING			/* health check connection under way */
+};
+
 enum state {
 	CONN,
 	PAGE,
 	MESS,
 	SEND,
 	QUIT,
-	LOGI
+	LOGI,
+	IDLE,
+	RSET,
+	DOWN,
+	WAIT,
+	DATA,
+	TEXT
+};
+
+struct snpp_stats {
+	unsigned long queued;		/* recipients, like sent and failed */
+	unsigned long sent;
+	unsigned long failed;
+	unsigned long merged;		/* pages folded into an earlier identical one */
+	guint max_depth;
+	unsigned long waited;		/* pages that got as far as PAGE */
+	unsigned long wait_total;	/* milliseconds from queueing to PAGE */
+	unsigned long wait_max;
+	unsigned long replayed;		/* pages picked up from the outbox at login */
+	unsigned long syncs;		/* outbox fsync() calls */
+	unsigned long retried;		/* pages put back after a transient failure */
+	unsigned long gave_up;		/* pages that ran out of attempts */
+	unsigned long uncertain;	/* recipients cut off after SEND went out */
+};
+
+struct snpp_data;
+struct snpp_server;
+
+struct snpp_session {
+	struct snpp_data *sd;		/* NULL once the account is gone */
+	struct snpp_server *server;
+	int fd;
+	guint inpa;
+	int state;			/* session state, DOWN while no connection is open */
+	guint idle_timer;
+	guint generation;		/* bumped each time the connection closes */
+	GString *inbuf;			/* received, not yet a complete reply */
+
+	GQueue *outq;			/* commands not written yet, oldest first */
+	gsize outoff;			/* bytes of the oldest one already written */
+	guint outpa;			/* write watcher while outq isn't empty */
+	GQueue *expect;			/* commands written or queued, awaiting a reply */
+	gboolean no_data;		/* the server refused DATA, stick to MESS */
+
+	GQueue *pages;			/* handed to this session, the head is being sent */
+};
+
+struct snpp_server {
+	char *host;
+	int port;
+	struct snpp_session *session;
+
+	int breaker;
+	guint failures;			/* in a row, connection level only */
+	guint cooldown;			/* seconds the breaker stays open next time */
+	time_t retry_at;		/* when an open breaker allows a health check */
+	guint reconnect_timer;		/* SNPP_RECONNECT_DELAY after a reset */
+
+	unsigned long sent;		/* recipients */
+	unsigned long trips;
+};
+
+struct snpp_data {
+	GaimConnection *gc;
+	GaimAccount *account;
+	GList *servers;			/* the "server" option first, then "servers" */
+	guint breaker_timer;
+	gboolean held;			/* told the user every server is down */
+
+	GQueue *queue;			/* pages waiting for a session, oldest first */
+	guint inflight;			/* pages handed to sessions and not finished */
+	struct snpp_stats stats;
+
+	int outbox;			/* append-only log of unfinished pages, -1 without */
+	guint outbox_sync;		/* pending group fsync() */
+	guint outbox_next;		/* id for the next page recorded */
+	guint outbox_pending;		/* recorded and not marked done */
+
+	GQueue *retries;		/* pages backing off, soonest first */
+	guint retry_timer;		/* fires for the head of retries */
+};
+
+struct snpp_page {
+	GSList *pagers;			/* recipients, one PAGE each ahead of the MESS */
+	guint npagers;
+	GSList *next;			/* recipient of the PAGE in progress */
+	char *message;
+	int state;			/* WAIT until its first PAGE goes out */
+	gboolean pipelined;		/* all PAGEs, MESS and SEND went out at once */
+	gboolean send_written;		/* the server may have accepted it already */
+	char *error;			/* a pipelined MESS was refused with this */
+	int error_code;
+	guint attempts;			/* transient failures so far */
+	time_t retry_at;		/* while on the retries queue */
+	GTimeVal queued;
+	GSList *ids;			/* outbox records this page stands for */
+};
+
+static GaimPlugin *_snpp_plugin = NULL;
+
+static void snpp_connect(struct snpp_session *ss);
+static void snpp_queue_run(struct snpp_data *sd);
+static void snpp_server_failed(struct snpp_server *sv);
+static void snpp_server_rest(struct snpp_server *sv);
+
+static struct snpp_page *snpp_page_new()
+{
+	struct snpp_page *sp;
+
+	gaim_debug_info("snpp", "snpp_page_new\n");
+	sp = g_new0(struct snpp_page, 1);
+	sp->state = WAIT;
+	g_get_current_time(&sp->queued);
+	return sp;
+};
+
+static void snpp_page_destroy(struct snpp_page *sp)
+{
+	gaim_debug_info("snpp", "snpp_page_destroy\n");
+
+	while (sp->pagers != NULL) {
+		g_free(sp->pagers->data);
+		sp->pagers = g_slist_delete_link(sp->pagers, sp->pagers);
+	}
+
+	if (sp->message != NULL)
+		g_free(sp->message);
+
+	if (sp->error != NULL)
+		g_free(sp->error);
+
+	g_slist_free(sp->ids);
+
+	g_free(sp);
+	sp = NULL;
+};
+
+static void snpp_page_add_pager(struct snpp_page *sp, const char *pager)
+{
+	sp->pagers = g_slist_append(sp->pagers, g_strdup(pager));
+	sp->npagers++;
+};
+
+/*
+ * Fold the pages waiting in queue with the same message as sp into it, so
+ * one MESS/SEND covers all their recipients. Returns how many were taken.
+ */
+static guint snpp_page_merge(struct snpp_data *sd, struct snpp_page *sp, GQueue *queue)
+{
+	struct snpp_page *other;
+	GList *l, *next;
+	guint merged = 0;
+
+	for (l = queue->head; l != NULL && sp->npagers < SNPP_MAX_RECIPIENTS; l = next) {
+		next = l->next;
+		other = l->data;
+
+		if (other == sp || other->state != WAIT
+				|| sp->npagers + other->npagers > SNPP_MAX_RECIPIENTS
+				|| strcmp(other->message, sp->message))
+			continue;
+
+		sp->pagers = g_slist_concat(sp->pagers, other->pagers);
+		sp->npagers += other->npagers;
+		other->pagers = NULL;
+		sp->ids = g_slist_concat(sp->ids, other->ids);
+		other->ids = NULL;
+		sp->attempts = MAX(sp->attempts, other->attempts);
+		g_queue_delete_link(queue, l);
+		snpp_page_destroy(other);
+		merged++;
+	}
+
+	sd->stats.merged += merged;
+	return merged;
+};
+
+/* Tell the user about one recipient, in its conversation if there is one */
+static void snpp_page_report(struct snpp_data *sd, const char *pager, const char *reply, gboolean error)
+{
+	GaimConversation *conv;
+
+	if ((conv = gaim_find_conversation_with_account(GAIM_CONV_TYPE_IM, pager, sd->account)))
+		gaim_conversation_write(conv, NULL, reply, GAIM_MESSAGE_SYSTEM | (error ? GAIM_MESSAGE_ERROR : 0), time(NULL));
+	else if (error)
+		gaim_notify_error(sd->gc, pager, reply, NULL);
+};
+
+/*
+ * The outbox: one "P" record per page as it is queued, one "D" record when
+ * the server has settled it, and an "R" record for a recipient settled on
+ * its own ahead of the rest. Pages without a "D" are replayed at the next
+ * login, so alerts survive gateway outages and restarts. Records are
+ * tab-separated and g_strescape()d; appends are fsync()ed in groups. A
+ * record only counts once its newline is on disk.
+ */
+static char *snpp_outbox_filename(GaimAccount *account)
+{
+	char *name, *filename;
+
+	name = g_strdup_printf("snpp-outbox-%s", gaim_escape_filename(gaim_account_get_username(account)));
+	filename = g_build_filename(gaim_user_dir(), name, NULL);
+	g_free(name);
+	return filename;
+};
+
+static gboolean snpp_outbox_sync_cb(gpointer data)
+{
+	struct snpp_data *sd = data;
+
+	gaim_debug_info("snpp", "snpp_outbox_sync_cb\n");
+
+	sd->outbox_sync = 0;
+	if (fsync(sd->outbox) < 0)
+		gaim_debug_warning("snpp", "snpp_outbox_sync_cb: %s\n", strerror(errno));
+	sd->stats.syncs++;
+
+	return FALSE;
+};
+
+static void snpp_outbox_write(struct snpp_data *sd, const char *record)
+{
+	size_t len = strlen(record);
+	ssize_t n;
+
+	if (sd->outbox < 0)
+		return;
+
+	if ((n = write(sd->outbox, record, len)) != (ssize_t)len) {
+		// A torn record must stay the last line, so stop logging here
+		gaim_debug_warning("snpp", "snpp_outbox_write: %s\n", n < 0 ? strerror(errno) : "short write");
+		close(sd->outbox);
+		sd->outbox = -1;
+		return;
+	}
+
+	if (!sd->outbox_sync)
+		sd->outbox_sync = gaim_timeout_add(SNPP_OUTBOX_SYNC_MS, snpp_outbox_sync_cb, sd);
+};
+
+static void snpp_outbox_add(struct snpp_data *sd, struct snpp_page *sp)
+{
+	GString *record;
+	char *escaped;
+	GSList *l;
+
+	gaim_debug_info("snpp", "snpp_outbox_add\n");
+
+	sp->ids = g_slist_prepend(NULL, GUINT_TO_POINTER(sd->outbox_next));
+	record = g_string_new(NULL);
+	g_string_printf(record, "P\t%u\t%ld\t", sd->outbox_next++, (long)sp->queued.tv_sec);
+
+	escaped = g_strescape(sp->message, NULL);
+	g_string_append(record, escaped);
+	g_free(escaped);
+
+	for (l = sp->pagers; l != NULL; l = l->next) {
+		escaped = g_strescape(l->data, NULL);
+		g_string_append_printf(record, "\t%s", escaped);
+		g_free(escaped);
+	}
+	g_string_append_c(record, '\n');
+
+	snpp_outbox_write(sd, record->str);
+	g_string_free(record, TRUE);
+	sd->outbox_pending++;
+};
+
+static void snpp_outbox_done(struct snpp_data *sd, struct snpp_page *sp)
+{
+	char record[32];
+	GSList *l;
+
+	gaim_debug_info("snpp", "snpp_outbox_done\n");
+
+	sd->outbox_pending -= g_slist_length(sp->ids);
+	if (sd->outbox_pending == 0 && sd->outbox >= 0) {
+		// Nothing left to replay, start the log afresh
+		if (ftruncate(sd->outbox, 0) < 0)
+			gaim_debug_warning("snpp", "snpp_outbox_done: %s\n", strerror(errno));
+		if (!sd->outbox_sync)
+			sd->outbox_sync = gaim_timeout_add(SNPP_OUTBOX_SYNC_MS, snpp_outbox_sync_cb, sd);
+		return;
+	}
+
+	for (l = sp->ids; l != NULL; l = l->next) {
+		g_snprintf(record, sizeof(record), "D\t%u\n", GPOINTER_TO_UINT(l->data));
+		snpp_outbox_write(sd, record);
+	}
+};
+
+/* A recipient left page sp ahead of the rest, whichever record holds it */
+static void snpp_outbox_drop(struct snpp_data *sd, struct snpp_page *sp, const char *pager)
+{
+	char *escaped, *record;
+	GSList *l;
+
+	gaim_debug_info("snpp", "snpp_outbox_drop\n");
+
+	escaped = g_strescape(pager, NULL);
+	for (l = sp->ids; l != NULL; l = l->next) {
+		record = g_strdup_printf("R\t%u\t%s\n", GPOINTER_TO_UINT(l->data), escaped);
+		snpp_outbox_write(sd, record);
+		g_free(record);
+	}
+	g_free(escaped);
+};
+
+/* Takes an "R" record's recipient off the page it names */
+static void snpp_outbox_parse_drop(GHashTable *pages, char *line)
+{
+	struct snpp_page *sp;
+	gchar **fields;
+	char *pager;
+	GSList *l;
+
+	fields = g_strsplit(line, "\t", 3);
+	if (fields[0] == NULL || fields[1] == NULL || fields[2] == NULL) {
+		g_strfreev(fields);
+		return;
+	}
+
+	sp = g_hash_table_lookup(pages, GUINT_TO_POINTER(strtoul(fields[1], NULL, 10)));
+	pager = g_strcompress(fields[2]);
+	for (l = sp != NULL ? sp->pagers : NULL; l != NULL; l = l->next) {
+		if (strcmp(l->data, pager) == 0) {
+			g_free(l->data);
+			sp->pagers = g_slist_delete_link(sp->pagers, l);
+			sp->npagers--;
+			break;
+		}
+	}
+	g_free(pager);
+	g_strfreev(fields);
+};
+
+/* A "P" record back into a page, NULL if the line is damaged */
+static struct snpp_page *snpp_outbox_parse(char *line, guint *id)
+{
+	struct snpp_page *sp;
+	gchar **fields;
+	int i;
+
+	fields = g_strsplit(line, "\t", -1);
+	for (i = 0; fields[i] != NULL; i++)
+		;
+
+	if (i < 5 || strcmp(fields[0], "P")) {
+		g_strfreev(fields);
+		return NULL;
+	}
+
+	sp = snpp_page_new();
+	*id = strtoul(fields[1], NULL, 10);
+	sp->queued.tv_sec = strtol(fields[2], NULL, 10);
+	sp->queued.tv_usec = 0;
+	sp->message = g_strcompress(fields[3]);
+	for (i = 4; fields[i] != NULL; i++) {
+		sp->pagers = g_slist_append(sp->pagers, g_strcompress(fields[i]));
+		sp->npagers++;
+	}
+	sp->ids = g_slist_prepend(NULL, GUINT_TO_POINTER(*id));
+
+	g_strfreev(fields);
+	return sp;
+};
+
+/*
+ * Queue every page the log holds without a "D", in their original order,
+ * and rewrite the log with just those so it doesn't grow across sessions.
+ */
+static void snpp_outbox_open(struct snpp_data *sd)
+{
+	GHashTable *pages;
+	GList *order = NULL, *l;
+	struct snpp_page *sp;
+	char *filename, *tmpname, *contents = NULL, *end;
+	gchar **lines;
+	guint id;
+	int i;
+
+	gaim_debug_info("snpp", "snpp_outbox_open\n");
+
+	filename = snpp_outbox_filename(sd->account);
+	pages = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	if (g_file_get_contents(filename, &contents, NULL, NULL)) {
+		// An append cut short by a crash has no newline, leave it out
+		if ((end = strrchr(contents, '\n')) != NULL)
+			end[1] = '\0';
+		else
+			*contents = '\0';
+
+		lines = g_strsplit(contents, "\n", -1);
+		for (i = 0; lines[i] != NULL; i++) {
+			if (lines[i][0] == 'R' && lines[i][1] == '\t')
+				snpp_outbox_parse_drop(pages, lines[i]);
+			else if (lines[i][0] == 'D' && lines[i][1] == '\t') {
+				id = strtoul(lines[i] + 2, NULL, 10);
+				if ((sp = g_hash_table_lookup(pages, GUINT_TO_POINTER(id))) != NULL) {
+					g_hash_table_remove(pages, GUINT_TO_POINTER(id));
+					snpp_page_destroy(sp);
+				}
+			} else if ((sp = snpp_outbox_parse(lines[i], &id)) != NULL) {
+				struct snpp_page *old = g_hash_table_lookup(pages, GUINT_TO_POINTER(id));
+
+				if (old != NULL)
+					snpp_page_destroy(old);
+				else
+					order = g_list_prepend(order, GUINT_TO_POINTER(id));
+				g_hash_table_insert(pages, GUINT_TO_POINTER(id), sp);
+			}
+		}
+		g_strfreev(lines);
+		g_free(contents);
+	}
+	order = g_list_reverse(order);
+
+	// Without a log the pages still go out, they just aren't durable
+	tmpname = g_strdup_printf("%s.new", filename);
+	if ((sd->outbox = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600)) < 0)
+		gaim_debug_warning("snpp", "snpp_outbox_open: %s: %s\n", tmpname, strerror(errno));
+
+	for (l = order; l != NULL; l = l->next) {
+		if ((sp = g_hash_table_lookup(pages, l->data)) == NULL)
+			continue;
+
+		// Renumbered from 0, in the same order
+		g_hash_table_remove(pages, l->data);
+		if (sp->pagers == NULL) {
+			// Every recipient was settled on its own
+			snpp_page_destroy(sp);
+			continue;
+		}
+		g_slist_free(sp->ids);
+		snpp_outbox_add(sd, sp);
+		g_queue_push_tail(sd->queue, sp);
+		sd->stats.queued += sp->npagers;
+		sd->stats.replayed++;
+	}
+	g_list_free(order);
+	g_hash_table_destroy(pages);
+
+	if (sd->outbox >= 0 && (fsync(sd->outbox) < 0 || rename(tmpname, filename) < 0)) {
+		gaim_debug_warning("snpp", "snpp_outbox_open: %s: %s\n", filename, strerror(errno));
+		close(sd->outbox);
+		sd->outbox = -1;
+	}
+	g_free(tmpname);
+	g_free(filename);
+
+	if (sd->outbox_sync) {
+		gaim_timeout_remove(sd->outbox_sync);
+		sd->outbox_sync = 0;
+	}
+
+	if (sd->stats.replayed > 0)
+		gaim_debug_info("snpp", "snpp_outbox_open: Replaying %lu pages\n", sd->stats.replayed);
+};
+
+static void snpp_outbox_close(struct snpp_data *sd)
+{
+	gaim_debug_info("snpp", "snpp_outbox_close\n");
+
+	if (sd->outbox_sync)
+		gaim_timeout_remove(sd->outbox_sync);
+
+	if (sd->outbox >= 0) {
+		fsync(sd->outbox);
+		close(sd->outbox);
+		sd->outbox = -1;
+	}
+};
+
+/*
+ * A page left its session, delivered or not. Done pages are marked off in
+ * the outbox; the rest, cut off by a failing connection, wait there for
+ * the next login.
+ */
+static void snpp_page_finish(struct snpp_data *sd, struct snpp_page *sp, gboolean sent, gboolean done)
+{
+	gaim_debug_info("snpp", "snpp_page_finish\n");
+
+	if (done)
+		snpp_outbox_done(sd, sp);
+
+	sd->inflight--;
+	if (sent)
+		sd->stats.sent += sp->npagers;
+	else
+		sd->stats.failed += sp->npagers;
+
+	snpp_page_destroy(sp);
+};
+
+/*
+ * 4xx replies end the session and 554 is a gateway failing for its own
+ * reasons: both are worth another go later. Other 5xx refusals (bad pager
+ * ID, message too long, syntax) would only fail the same way again.
+ */
+static gboolean snpp_code_transient(int code)
+{
+	return (code >= 400 && code < 500) || code == 554;
+};
+
+static gint snpp_retry_compare(gconstpointer a, gconstpointer b, gpointer data)
+{
+	const struct snpp_page *pa = a, *pb = b;
+
+	return pa->retry_at < pb->retry_at ? -1 : pa->retry_at > pb->retry_at;
+};
+
+static gboolean snpp_retry_cb(gpointer data);
+
+static void snpp_retry_schedule(struct snpp_data *sd)
+{
+	struct snpp_page *sp;
+
+	gaim_debug_info("snpp", "snpp_retry_schedule\n");
+
+	if (sd->retry_timer) {
+		gaim_timeout_remove(sd->retry_timer);
+		sd->retry_timer = 0;
+	}
+
+	if ((sp = g_queue_peek_head(sd->retries)) != NULL)
+		sd->retry_timer = gaim_timeout_add(MAX(sp->retry_at - time(NULL), 1) * 1000, snpp_retry_cb, sd);
+};
+
+static gboolean snpp_retry_cb(gpointer data)
+{
+	struct snpp_data *sd = data;
+	struct snpp_page *sp;
+	GList *due = NULL, *l;
+	time_t now = time(NULL);
+
+	gaim_debug_info("snpp", "snpp_retry_cb\n");
+
+	sd->retry_timer = 0;
+
+	while ((sp = g_queue_peek_head(sd->retries)) != NULL && sp->retry_at <= now)
+		due = g_list_prepend(due, g_queue_pop_head(sd->retries));
+
+	// Ahead of anything queued since, and in their original order
+	for (l = due; l != NULL; l = l->next)
+		g_queue_push_head(sd->queue, l->data);
+	g_list_free(due);
+
+	snpp_retry_schedule(sd);
+	snpp_queue_run(sd);
+	return FALSE;
+};
+
+/*
+ * Backs a page that failed for a passing reason off to the retries queue,
+ * SNPP_RETRY_BASE seconds doubling with each attempt, with the upper half
+ * randomised so a gateway coming back up doesn't get every page at once.
+ * The page must no longer count as inflight. It stays unfinished in the
+ * outbox throughout.
+ */
+static void snpp_page_retry(struct snpp_data *sd, struct snpp_page *sp, const char *reply)
+{
+	char *msg;
+	GSList *l;
+	guint delay;
+
+	gaim_debug_info("snpp", "snpp_page_retry\n");
+
+	if (sp->attempts >= SNPP_RETRY_MAX_ATTEMPTS) {
+		msg = g_strdup_printf(_("%s (gave up after %u attempts)"), reply, sp->attempts + 1);
+		for (l = sp->pagers; l != NULL; l = l->next)
+			snpp_page_report(sd, l->data, msg, TRUE);
+		g_free(msg);
+
+		snpp_outbox_done(sd, sp);
+		sd->stats.failed += sp->npagers;
+		sd->stats.gave_up++;
+		snpp_page_destroy(sp);
+		return;
+	}
+
+	delay = MIN(SNPP_RETRY_BASE << sp->attempts, SNPP_RETRY_MAX_DELAY);
+	delay = delay / 2 + g_random_int_range(0, delay / 2 + 1);
+	sp->attempts++;
+	sp->retry_at = time(NULL) + delay;
+
+	sp->state = WAIT;
+	sp->next = NULL;
+	sp->pipelined = FALSE;
+	sp->send_written = FALSE;
+	if (sp->error != NULL) {
+		g_free(sp->error);
+		sp->error = NULL;
+	}
+	sp->error_code = 0;
+
+	gaim_debug_warning("snpp", "snpp_page_retry: %s, attempt %u in %u seconds\n", reply, sp->attempts + 1, delay);
+
+	// Open conversations hear about it, nobody gets a dialog until we give up
+	msg = g_strdup_printf(_("%s (retrying in %u seconds)"), reply, delay);
+	for (l = sp->pagers; l != NULL; l = l->next)
+		snpp_page_report(sd, l->data, msg, FALSE);
+	g_free(msg);
+
+	sd->stats.retried++;
+	g_queue_insert_sorted(sd->retries, sp, snpp_retry_compare, NULL);
+	if (g_queue_peek_head(sd->retries) == sp)
+		snpp_retry_schedule(sd);
+};
+
+/* Connection lost after SEND: tell the user rather than risk a second page */
+static void snpp_page_uncertain(struct snpp_data *sd, struct snpp_page *sp, const char *reason)
+{
+	char *msg;
+	GSList *l;
+
+	gaim_debug_info("snpp", "snpp_page_uncertain\n");
+
+	msg = g_strdup_printf(_("%s (the page may or may not have been sent)"), reason);
+	for (l = sp->pagers; l != NULL; l = l->next)
+		snpp_page_report(sd, l->data, msg, TRUE);
+	g_free(msg);
+
+	snpp_outbox_done(sd, sp);
+	sd->stats.uncertain += sp->npagers;
+	snpp_page_destroy(sp);
+};
+
+static void snpp_retry_free(struct snpp_data *sd)
+{
+	struct snpp_page *sp;
+
+	gaim_debug_info("snpp", "snpp_retry_free\n");
+
+	if (sd->retry_timer)
+		gaim_timeout_remove(sd->retry_timer);
+
+	// Still in the outbox, they come back at the next login
+	while ((sp = g_queue_pop_head(sd->retries)) != NULL)
+		snpp_page_destroy(sp);
+	g_queue_free(sd->retries);
+};
+
+static struct snpp_session *snpp_session_new(struct snpp_data *sd, struct snpp_server *sv)
+{
+	struct snpp_session *ss;
+
+	gaim_debug_info("snpp", "snpp_session_new\n");
+	ss = g_new0(struct snpp_session, 1);
+	ss->sd = sd;
+	ss->server = sv;
+	ss->fd = -1;
+	ss->state = DOWN;
+	ss->inbuf = g_string_sized_new(SNPP_INITIAL_BUFSIZE);
+	ss->outq = g_queue_new();
+	ss->expect = g_queue_new();
+	ss->pages = g_queue_new();
+	return ss;
+};
+
+static void snpp_session_close(struct snpp_session *ss)
+{
+	gaim_debug_info("snpp", "snpp_session_close\n");
+	if (ss->inpa) {
+		gaim_input_remove(ss->inpa);
+		ss->inpa = 0;
+	}
+
+	if (ss->outpa) {
+		gaim_input_remove(ss->outpa);
+		ss->outpa = 0;
+	}
+
+	while (!g_queue_is_empty(ss->outq))
+		g_free(g_queue_pop_head(ss->outq));
+	ss->outoff = 0;
+	g_queue_clear(ss->expect);
+
+	if (ss->idle_timer) {
+		gaim_timeout_remove(ss->idle_timer);
+		ss->idle_timer = 0;
+	}
+
+	if (ss->fd >= 0) {
+		close(ss->fd);
+		ss->fd = -1;
+	}
+
+	g_string_truncate(ss->inbuf, 0);
+	ss->generation++;
+	ss->state = DOWN;
+};
+
+/*
+ * Drop the connection. Only a page caught in the middle of its transaction
+ * fails with it; those not started go back to the front of the account
+ * queue, for whichever server is healthy. The server gets a short rest
+ * either way, but only a failed connect, an I/O error or a hang-up
+ * (failed) counts towards its breaker: a server that talks nonsense or
+ * refuses a command is still up.
+ */
+static void snpp_session_reset(struct snpp_session *ss, const char *reason, gboolean failed)
+{
+	struct snpp_data *sd = ss->sd;
+	struct snpp_page *sp;
+	char *why;
+
+	gaim_debug_info("snpp", "snpp_session_reset\n");
+
+	// reason is often a reply still in ss->inbuf, which closing empties
+	why = g_strdup(reason);
+	snpp_session_close(ss);
+
+	if (why != NULL)
+		gaim_debug_warning("snpp", "snpp_session_reset: %s:%d: %s\n", ss->server->host, ss->server->port, why);
+
+	while ((sp = g_queue_pop_tail(ss->pages)) != NULL) {
+		sd->inflight--;
+		if (sp->state == WAIT)
+			g_queue_push_head(sd->queue, sp);
+		else if (sp->send_written) {
+			// It may have gone out, sending it again could page twice
+			snpp_page_uncertain(sd, sp, why != NULL ? why : _("Connection lost"));
+		} else {
+			// Cut off half way through, before any SEND
+			snpp_page_retry(sd, sp, why != NULL ? why : _("Connection lost"));
+		}
+	}
+	g_free(why);
+
+	snpp_server_rest(ss->server);
+	// A health check that went wrong in any way keeps the breaker open
+	if (failed || ss->server->breaker == BREAKER_PROBING)
+		snpp_server_failed(ss->server);
+	snpp_queue_run(sd);
+};
+
+static void snpp_session_destroy(struct snpp_session *ss)
+{
+	struct snpp_page *sp;
+
+	gaim_debug_info("snpp", "snpp_session_destroy\n");
+
+	while ((sp = g_queue_pop_head(ss->pages)) != NULL)
+		snpp_page_destroy(sp);
+
+	if (ss->state == CONN && ss->fd < 0) {
+		// gaim_proxy_connect can't be cancelled, snpp_connect_cb frees it
+		ss->sd = NULL;
+		return;
+	}
+
+	snpp_session_close(ss);
+	g_string_free(ss->inbuf, TRUE);
+	g_queue_free(ss->outq);
+	g_queue_free(ss->expect);
+	g_queue_free(ss->pages);
+	g_free(ss);
+};
+
+/*
+ * Write out what is queued, several commands to one writev(), as far as the
+ * socket takes them. Runs from the write watcher, so commands queued during
+ * one main loop iteration go out together.
+ */
+static void snpp_flush(gpointer data, gint source, GaimInputCondition cond)
+{
+	struct snpp_session *ss = data;
+	struct iovec iov[SNPP_MAX_IOV];
+	struct snpp_page *sp;
+	char *command;
+	ssize_t len;
+	gsize left;
+	GList *l;
+	int n;
+
+	gaim_debug_info("snpp", "snpp_flush\n");
+
+	for (n = 0, l = ss->outq->head; l != NULL && n < SNPP_MAX_IOV; n++, l = l->next) {
+		command = l->data;
+		iov[n].iov_base = command + (n == 0 ? ss->outoff : 0);
+		iov[n].iov_len = strlen(command) - (n == 0 ? ss->outoff : 0);
+	}
+
+	if ((len = writev(ss->fd, iov, n)) < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		gaim_debug_warning("snpp", "snpp_flush: Error sending message\n");
+		snpp_session_reset(ss, _("Write error"), TRUE);
+		return;
+	}
+
+	while (len > 0) {
+		command = g_queue_peek_head(ss->outq);
+		left = strlen(command) - ss->outoff;
+		if ((gsize)len < left) {
+			ss->outoff += len;
+			break;
+		}
+		len -= left;
+		ss->outoff = 0;
+		command = g_queue_pop_head(ss->outq);
+		if (!strcmp(command, "SEND\r\n") && (sp = g_queue_peek_head(ss->pages)) != NULL && sp->state == SEND)
+			sp->send_written = TRUE;
+		g_free(command);
+	}
+
+	if (g_queue_is_empty(ss->outq)) {
+		gaim_input_remove(ss->outpa);
+		ss->outpa = 0;
+	}
+};
+
+/* Queue a command (taking it over) whose reply will be handled as state */
+static void snpp_send(struct snpp_session *ss, int state, char *command)
+{
+	gaim_debug_info("snpp", "snpp_send\n");
+
+	gaim_debug_info("snpp", "snpp_send: sending %s\n", command);
+	g_queue_push_tail(ss->outq, command);
+	g_queue_push_tail(ss->expect, GINT_TO_POINTER(state));
+	ss->state = state;
+
+	if (!ss->outpa)
+		ss->outpa = gaim_input_add(ss->fd, GAIM_INPUT_WRITE, snpp_flush, ss);
+};
+
+static int snpp_cmd_logi(struct snpp_session *ss)
+{
+	const char *password;
+
+	gaim_debug_info("snpp", "snpp_cmd_logi\n");
+
+	if ((password = gaim_account_get_password(ss->sd->account)) == NULL)
+		password = "";
+
+	// If LOGI is unsupported, this should return 500
+	snpp_send(ss, LOGI, g_strdup_printf("LOGI %s %s\r\n",
+			gaim_account_get_username(ss->sd->account),
+			password));
+
+	return 0;
+}
+
+static int snpp_cmd_page(struct snpp_session *ss, const char *pager)
+{
+	struct snpp_page *sp = g_queue_peek_head(ss->pages);
+
+	gaim_debug_info("snpp", "snpp_cmd_page\n");
+
+	sp->state = PAGE;
+	snpp_send(ss, PAGE, g_strdup_printf("PAGE %s\r\n", pager));
+
+	return 0;
+};
+
+static int snpp_cmd_mess(struct snpp_session *ss)
+{
+	struct snpp_page *sp = g_queue_peek_head(ss->pages);
+	char *command;
+
+	gaim_debug_info("snpp", "snpp_cmd_mess\n");
+
+	// MESS is a single line
+	command = g_strdup_printf("MESS %s\r\n", sp->message);
+	g_strdelimit(command + 5, "\r\n", ' ');
+	strcpy(command + strlen(command) - 2, "\r\n");
+
+	sp->state = MESS;
+	snpp_send(ss, MESS, command);
+
+	return 0;
+};
+
+static int snpp_cmd_data(struct snpp_session *ss)
+{
+	struct snpp_page *sp = g_queue_peek_head(ss->pages);
+
+	gaim_debug_info("snpp", "snpp_cmd_data\n");
+
+	sp->state = DATA;
+	snpp_send(ss, DATA, g_strdup("DATA\r\n"));
+
+	return 0;
+};
+
+/*
+ * The text following a 354 to DATA, straight from the message: CRLF line
+ * ends, a '.' doubled at the start of a line, and a lone "." to finish.
+ */
+static int snpp_cmd_text(struct snpp_session *ss)
+{
+	struct snpp_page *sp = g_queue_peek_head(ss->pages);
+	const char *line, *eol;
+	GString *text;
+	size_t len;
+
+	gaim_debug_info("snpp", "snpp_cmd_text\n");
+
+	text = g_string_sized_new(strlen(sp->message) + 16);
+	for (line = sp->message; *line != '\0'; line = eol) {
+		len = strcspn(line, "\r\n");
+		if (*line == '.')
+			g_string_append_c(text, '.');
+		g_string_append_len(text, line, len);
+		g_string_append(text, "\r\n");
+
+		eol = line + len;
+		if (*eol == '\r')
+			eol++;
+		if (*eol == '\n')
+			eol++;
+	}
+	g_string_append(text, ".\r\n");
+
+	sp->state = TEXT;
+	snpp_send(ss, TEXT, g_string_free(text, FALSE));
+
+	return 0;
+};
+
+static int snpp_cmd_send(struct snpp_session *ss)
+{
+	struct snpp_page *sp = g_queue_peek_head(ss->pages);
+
+	gaim_debug_info("snpp", "snpp_cmd_send\n");
+
+	sp->state = SEND;
+	snpp_send(ss, SEND, g_strdup("SEND\r\n"));
+
+	return 0;
+};
+
+/* MESS for short one-line messages, DATA for the rest if the server has it */
+static void snpp_cmd_body(struct snpp_session *ss)
+{
+	struct snpp_page *sp = g_queue_peek_head(ss->pages);
+
+	gaim_debug_info("snpp", "snpp_cmd_body\n");
+
+	if (!ss->no_data && (strlen(sp->message) > SNPP_MESS_MAX || strpbrk(sp->message, "\r\n") != NULL)) {
+		// Pipelined or not, the text has to wait for the 354
+		snpp_cmd_data(ss);
+		return;
+	}
+
+	snpp_cmd_mess(ss);
+	if (sp->pipelined)
+		snpp_cmd_send(ss);
+};
+
+static int snpp_cmd_quit(struct snpp_session *ss)
+{
+	gaim_debug_info("snpp", "snpp_cmd_quit\n");
+
+	snpp_send(ss, QUIT, g_strdup("QUIT\r\n"));
+
+	return 0;
+};
+
+static int snpp_cmd_rset(struct snpp_session *ss)
+{
+	gaim_debug_info("snpp", "snpp_cmd_rset\n");
+
+	snpp_send(ss, RSET, g_strdup("RSET\r\n"));
+
+	return 0;
 };
 
-struct snpp_data {
-	GaimAccount *account;
-	int fd;
+/*
+ * Start the head page of the session. Pipelined, every PAGE, the MESS and
+ * the SEND go out in one write and the replies are matched up in order
+ * (with DATA, the text and SEND follow the 354); otherwise each command
+ * waits for the reply to the one before.
+ */
+static void snpp_page_start(struct snpp_session *ss)
+{
+	struct snpp_data *sd = ss->sd;
+	struct snpp_stats *stats = &sd->stats;
+	struct snpp_page *sp = g_queue_peek_head(ss->pages);
+	unsigned long wait;
+	GTimeVal now;
+	GSList *l;
+
+	gaim_debug_info("snpp", "snpp_page_start\n");
+
+	g_get_current_time(&now);
+	wait = (now.tv_sec - sp->queued.tv_sec) * 1000 + (now.tv_usec - sp->queued.tv_usec) / 1000;
+	stats->waited++;
+	stats->wait_total += wait;
+	if (wait > stats->wait_max)
+		stats->wait_max = wait;
+
+	// Same message further back, on this session or still queued
+	sd->inflight -= snpp_page_merge(sd, sp, ss->pages);
+	snpp_page_merge(sd, sp, sd->queue);
+	sp->next = sp->pagers;
+
+	sp->pipelined = gaim_account_get_bool(sd->account, "pipeline", TRUE);
+	if (!sp->pipelined) {
+		snpp_cmd_page(ss, sp->next->data);
+		return;
+	}
 
-	struct snpp_page *current_page;
+	for (l = sp->pagers; l != NULL; l = l->next)
+		snpp_cmd_page(ss, l->data);
+	snpp_cmd_body(ss);
 };
 
-struct snpp_page {
-	char *pager;
-	char *message;
-	int state;
+static gboolean snpp_idle_cb(gpointer data)
+{
+	struct snpp_session *ss = data;
+
+	gaim_debug_info("snpp", "snpp_idle_cb\n");
+
+	ss->idle_timer = 0;
+	if (ss->state == IDLE)
+		snpp_cmd_quit(ss);
+
+	return FALSE;
 };
 
-static GaimPlugin *_snpp_plugin = NULL;
+/*
+ * The session is logged in with nothing outstanding: start its next page,
+ * or keep the connection around until the idle timeout instead of QUITting.
+ */
+static void snpp_session_ready(struct snpp_session *ss)
+{
+	int timeout;
 
-static struct snpp_page *snpp_page_new()
+	gaim_debug_info("snpp", "snpp_session_ready\n");
+
+	if (!g_queue_is_empty(ss->pages)) {
+		snpp_page_start(ss);
+		return;
+	}
+
+	timeout = gaim_account_get_int(ss->sd->account, "idle_timeout", SNPP_DEFAULT_IDLE_TIMEOUT);
+	if (timeout <= 0) {
+		snpp_cmd_quit(ss);
+		return;
+	}
+
+	ss->state = IDLE;
+	ss->idle_timer = gaim_timeout_add(timeout * 1000, snpp_idle_cb, ss);
+};
+
+/* Get pages moving on a session: connect it, or wake it from idle */
+static void snpp_session_kick(struct snpp_session *ss)
 {
-	struct snpp_page *sp;
+	gaim_debug_info("snpp", "snpp_session_kick\n");
 
-	gaim_debug_info("snpp", "snpp_page_new\n");
-	sp = g_new0(struct snpp_page, 1);
-	sp->state = CONN;
-	return sp;
+	switch (ss->state) {
+	case DOWN:
+		/* Get ball rolling, snpp_callback will take over */
+		snpp_connect(ss);
+		break;
+
+	case IDLE:
+		/* Reuse the logged in session, no reconnect or LOGI */
+		gaim_timeout_remove(ss->idle_timer);
+		ss->idle_timer = 0;
+		snpp_page_start(ss);
+		break;
+
+	default:
+		/* Session busy, snpp_session_ready() picks the page up */
+		break;
+	}
 };
 
-static void snpp_page_destroy(struct snpp_page *sp)
+static gboolean snpp_breaker_cb(gpointer data);
+
+/* Wake up for the earliest open breaker that may be health checked */
+static void snpp_breaker_schedule(struct snpp_data *sd)
 {
-	gaim_debug_info("snpp", "snpp_page_destroy\n");
+	struct snpp_server *sv;
+	time_t next = 0;
+	GList *l;
 
-	if (sp->pager != NULL)
-		g_free(sp->pager);
+	gaim_debug_info("snpp", "snpp_breaker_schedule\n");
 
-	if (sp->message != NULL)
-		g_free(sp->message);
+	if (sd->breaker_timer) {
+		gaim_timeout_remove(sd->breaker_timer);
+		sd->breaker_timer = 0;
+	}
 
-	g_free(sp);
-	sp = NULL;
+	for (l = sd->servers; l != NULL; l = l->next) {
+		sv = l->data;
+		if (sv->breaker == BREAKER_OPEN && (next == 0 || sv->retry_at < next))
+			next = sv->retry_at;
+	}
+
+	if (next != 0)
+		sd->breaker_timer = gaim_timeout_add(MAX(next - time(NULL), 1) * 1000, snpp_breaker_cb, sd);
 };
 
-static void snpp_send(gint fd, const char *buf)
+/* Health check: a bare connection and LOGI, no pages, closes the breaker */
+static gboolean snpp_breaker_cb(gpointer data)
 {
-	gaim_debug_info("snpp", "snpp_send\n");
+	struct snpp_data *sd = data;
+	struct snpp_server *sv;
+	time_t now = time(NULL);
+	GList *l;
+
+	gaim_debug_info("snpp", "snpp_breaker_cb\n");
+
+	sd->breaker_timer = 0;
+	for (l = sd->servers; l != NULL; l = l->next) {
+		sv = l->data;
+		if (sv->breaker != BREAKER_OPEN || sv->retry_at > now)
+			continue;
+
+		gaim_debug_info("snpp", "snpp_breaker_cb: Checking %s:%d\n", sv->host, sv->port);
+		sv->breaker = BREAKER_PROBING;
+		if (sv->session->state == DOWN)
+			snpp_connect(sv->session);
+	}
+
+	snpp_breaker_schedule(sd);
+	return FALSE;
+};
+
+/* A connection to sv failed or dropped */
+static void snpp_server_failed(struct snpp_server *sv)
+{
+	struct snpp_data *sd = sv->session->sd;
+	GList *l;
+
+	gaim_debug_info("snpp", "snpp_server_failed\n");
+
+	sv->failures++;
+	if (sv->breaker == BREAKER_CLOSED && sv->failures < SNPP_BREAKER_THRESHOLD)
+		return;
+
+	if (sv->breaker == BREAKER_CLOSED) {
+		gaim_debug_warning("snpp", "snpp_server_failed: %s:%d failed %u times, breaker open\n",
+				sv->host, sv->port, sv->failures);
+		sv->trips++;
+	}
+
+	sv->breaker = BREAKER_OPEN;
+	sv->retry_at = time(NULL) + sv->cooldown;
+	sv->cooldown = MIN(sv->cooldown * 2, SNPP_BREAKER_MAX_COOLDOWN);
+	snpp_breaker_schedule(sd);
 
-	gaim_debug_info("snpp", "snpp_send: sending %s\n", buf);
-	if (!write(fd,buf,strlen(buf))) {
-		gaim_debug_warning("snpp", "snpp_send: Error sending message\n");
+	for (l = sd->servers; l != NULL; l = l->next)
+		if (((struct snpp_server *)l->data)->breaker == BREAKER_CLOSED)
+			return;
+
+	if (!sd->held) {
+		sd->held = TRUE;
+		gaim_notify_error(sd->gc, NULL, _("No SNPP server is answering"),
+				_("Pages are held until one of the servers recovers."));
 	}
 };
 
-static void snpp_reset(GaimConnection *gc, struct snpp_data *sd)
+static gboolean snpp_server_rest_cb(gpointer data)
 {
-	gaim_debug_info("snpp", "snpp_reset\n");
-	if (gc->inpa)
-		gaim_input_remove(gc->inpa);
+	struct snpp_server *sv = data;
 
-	close(sd->fd);
+	gaim_debug_info("snpp", "snpp_server_rest_cb\n");
 
-	if (sd->current_page != NULL)
-		snpp_page_destroy(sd->current_page);
-}
+	sv->reconnect_timer = 0;
+	snpp_queue_run(sv->session->sd);
+	return FALSE;
+};
 
-static int snpp_cmd_logi(struct snpp_data *sd)
+/* Keep sv out of snpp_server_pick() for SNPP_RECONNECT_DELAY, not straight back to it */
+static void snpp_server_rest(struct snpp_server *sv)
 {
-	char command[SNPP_INITIAL_BUFSIZE];
-	const char *password;
+	gaim_debug_info("snpp", "snpp_server_rest\n");
 
-	gaim_debug_info("snpp", "snpp_cmd_logi\n");
+	if (sv->reconnect_timer)
+		gaim_timeout_remove(sv->reconnect_timer);
+	sv->reconnect_timer = gaim_timeout_add(SNPP_RECONNECT_DELAY * 1000, snpp_server_rest_cb, sv);
+};
 
-	if ((password = gaim_account_get_password(sd->account)) == NULL)
-		password = "";
+/* LOGI went through on sv */
+static void snpp_server_ok(struct snpp_server *sv)
+{
+	struct snpp_data *sd = sv->session->sd;
 
-	// If LOGI is unsupported, this should return 500
-	sd->current_page->state = LOGI;
-	g_snprintf(command, sizeof(command), "LOGI %s %s\n",
-			gaim_account_get_username(sd->account),
-			password);
+	gaim_debug_info("snpp", "snpp_server_ok\n");
 
-	snpp_send(sd->fd, command);
+	sv->failures = 0;
+	sv->cooldown = SNPP_BREAKER_COOLDOWN;
+	if (sv->breaker == BREAKER_CLOSED)
+		return;
 
-	return 0;
-}
+	gaim_debug_info("snpp", "snpp_server_ok: %s:%d is back\n", sv->host, sv->port);
+	sv->breaker = BREAKER_CLOSED;
+	sd->held = FALSE;
+	snpp_breaker_schedule(sd);
+	snpp_queue_run(sd);
+};
 
-static int snpp_cmd_page(struct snpp_data *sd)
+/* Pages on the server's session, sent or waiting there */
+static guint snpp_server_outstanding(struct snpp_server *sv)
 {
-	char command[SNPP_INITIAL_BUFSIZE];
+	return g_queue_get_length(sv->session->pages);
+};
 
-	gaim_debug_info("snpp", "snpp_cmd_page\n");
+/* The healthy server with the fewest outstanding pages, earlier ones on ties */
+static struct snpp_server *snpp_server_pick(struct snpp_data *sd)
+{
+	struct snpp_server *sv, *best = NULL;
+	GList *l;
+
+	for (l = sd->servers; l != NULL; l = l->next) {
+		sv = l->data;
+		if (sv->breaker != BREAKER_CLOSED)
+			continue;
+		// Resting after a reset, unless it reconnected on its own meanwhile
+		if (sv->reconnect_timer && sv->session->state == DOWN)
+			continue;
+		if (best == NULL || snpp_server_outstanding(sv) < snpp_server_outstanding(best))
+			best = sv;
+	}
 
-	sd->current_page->state = PAGE;
-	g_snprintf(command, sizeof(command), "PAGE %s\n", sd->current_page->pager);
-	snpp_send(sd->fd, command);
+	return best;
+};
 
-	return 0;
+static void snpp_server_add(struct snpp_data *sd, const char *host, int port)
+{
+	struct snpp_server *sv;
+	GList *l;
+
+	for (l = sd->servers; l != NULL; l = l->next) {
+		sv = l->data;
+		if (sv->port == port && !g_ascii_strcasecmp(sv->host, host))
+			return;
+	}
+
+	gaim_debug_info("snpp", "snpp_server_add: %s:%d\n", host, port);
+	sv = g_new0(struct snpp_server, 1);
+	sv->host = g_strdup(host);
+	sv->port = port;
+	sv->breaker = BREAKER_CLOSED;
+	sv->cooldown = SNPP_BREAKER_COOLDOWN;
+	sv->session = snpp_session_new(sd, sv);
+	sd->servers = g_list_append(sd->servers, sv);
 };
 
-static int snpp_cmd_mess(struct snpp_data *sd)
+/* "server"/"port", then each "host[:port]" of the "servers" list */
+static void snpp_servers_init(struct snpp_data *sd)
 {
-	char command[SNPP_INITIAL_BUFSIZE];
+	int port = gaim_account_get_int(sd->account, "port", SNPP_DEFAULT_PORT);
+	gchar **servers;
+	char *colon;
+	int i;
 
-	gaim_debug_info("snpp", "snpp_cmd_mess\n");
+	gaim_debug_info("snpp", "snpp_servers_init\n");
 
-	sd->current_page->state = MESS;
-	g_snprintf(command, sizeof(command), "MESS %s\n", sd->current_page->message);
-	snpp_send(sd->fd, command);
+	snpp_server_add(sd, gaim_account_get_string(sd->account, "server", SNPP_DEFAULT_SERVER), port);
 
-	return 0;
+	servers = g_strsplit_set(gaim_account_get_string(sd->account, "servers", ""), " ,;\t", -1);
+	for (i = 0; servers[i] != NULL; i++) {
+		if (*servers[i] == '\0')
+			continue;
+
+		if ((colon = strrchr(servers[i], ':')) != NULL) {
+			*colon = '\0';
+			snpp_server_add(sd, servers[i], atoi(colon + 1) > 0 ? atoi(colon + 1) : port);
+		} else
+			snpp_server_add(sd, servers[i], port);
+	}
+	g_strfreev(servers);
 };
 
-static int snpp_cmd_send(struct snpp_data *sd)
+static void snpp_servers_free(struct snpp_data *sd)
 {
-	char command[SNPP_INITIAL_BUFSIZE];
+	struct snpp_server *sv;
 
-	gaim_debug_info("snpp", "snpp_cmd_send\n");
+	gaim_debug_info("snpp", "snpp_servers_free\n");
 
-	sd->current_page->state = SEND;
-	g_snprintf(command, sizeof(command), "SEND\n");
-	snpp_send(sd->fd, command);
+	if (sd->breaker_timer)
+		gaim_timeout_remove(sd->breaker_timer);
 
-	return 0;
+	while (sd->servers != NULL) {
+		sv = sd->servers->data;
+		if (sv->reconnect_timer)
+			gaim_timeout_remove(sv->reconnect_timer);
+		snpp_session_destroy(sv->session);
+		g_free(sv->host);
+		g_free(sv);
+		sd->servers = g_list_delete_link(sd->servers, sd->servers);
+	}
 };
 
-static int snpp_cmd_quit(struct snpp_data *sd)
+/*
+ * Hand queued pages to sessions, oldest first, up to the in-flight limit,
+ * each to the healthy server with the least outstanding. With every
+ * breaker open they stay queued for the health checks to release.
+ */
+static void snpp_queue_run(struct snpp_data *sd)
 {
-	char command[SNPP_INITIAL_BUFSIZE];
+	struct snpp_server *sv;
+	struct snpp_page *sp;
+	int limit;
 
-	gaim_debug_info("snpp", "snpp_cmd_quit\n");
+	gaim_debug_info("snpp", "snpp_queue_run\n");
 
-	sd->current_page->state = QUIT;
-	g_snprintf(command, sizeof(command), "QUIT\n");
-	snpp_send(sd->fd, command);
+	limit = gaim_account_get_int(sd->account, "max_inflight", SNPP_DEFAULT_MAX_INFLIGHT);
+	if (limit < 1)
+		limit = 1;
 
-	return 0;
+	while (sd->inflight < (guint)limit && !g_queue_is_empty(sd->queue)
+			&& (sv = snpp_server_pick(sd)) != NULL) {
+		sp = g_queue_pop_head(sd->queue);
+		g_queue_push_tail(sv->session->pages, sp);
+		sd->inflight++;
+		snpp_session_kick(sv->session);
+	}
 };
 
-static void snpp_callback(gpointer data, gint source, GaimInputCondition cond)
+/* The server refused the page being sent; the session itself is still good */
+static void snpp_page_failed(struct snpp_session *ss, int code, const char *reply)
 {
-	GaimConnection *gc;
-	struct snpp_data *sd;
-	int len;
-	char buf[SNPP_INITIAL_BUFSIZE];
-	char *retcode = NULL;
-	GaimConversation *conv;
+	struct snpp_page *sp = g_queue_pop_head(ss->pages);
+	GSList *l;
 
-	gaim_debug_info("snpp", "snpp_callback\n");
+	gaim_debug_info("snpp", "snpp_page_failed\n");
 
-	gc = data;
-	sd = gc->proto_data;
+	if (snpp_code_transient(code)) {
+		ss->sd->inflight--;
+		snpp_page_retry(ss->sd, sp, reply);
+	} else {
+		for (l = sp->pagers; l != NULL; l = l->next)
+			snpp_page_report(ss->sd, l->data, reply, TRUE);
+		snpp_page_finish(ss->sd, sp, FALSE, TRUE);
+	}
+	snpp_cmd_rset(ss);
+	snpp_queue_run(ss->sd);
+};
 
-	if ((len = read(sd->fd, buf, SNPP_INITIAL_BUFSIZE - 1)) < 0) {
-		gaim_debug_warning("snpp", "snpp_callback: Read error\n");
-		/* gaim_connection_error(gc, _("Read error")); */
-		return;
-	} else if (len == 0) {
-		/* Remote closed the connection, probably */
+/* One complete reply, multi-line ones included, in whatever state the session is */
+static void snpp_reply(struct snpp_session *ss, int code, const char *text)
+{
+	struct snpp_data *sd = ss->sd;
+	struct snpp_page *sp, *retry;
+	GSList *l;
+	int state;
+
+	gaim_debug_info("snpp", "snpp_reply: Recv: %s\n", text);
+
+	if (code == 0) {
+		// Not SNPP, nothing after it can be matched to a command
+		gaim_debug_warning("snpp", "snpp_reply: Malformed reply\n");
+		sp = g_queue_peek_head(ss->pages);
+		if (sp != NULL && sp->state != WAIT) {
+			char *msg = g_strdup_printf(_("Protocol error: %s"), text);
+
+			g_queue_pop_head(ss->pages);
+			for (l = sp->pagers; l != NULL; l = l->next)
+				snpp_page_report(sd, l->data, msg, TRUE);
+			g_free(msg);
+			snpp_page_finish(sd, sp, FALSE, TRUE);
+		}
+		snpp_session_reset(ss, _("Protocol error"), FALSE);
 		return;
 	}
 
-	buf[len] = '\0';
-	gaim_debug_info("snpp", "snpp_callback: Recv: %s\n", buf);
-	retcode = g_strndup(buf,3);
-
-	if (sd->current_page != NULL) {
-		gaim_debug_info("snpp", "snpp_callback: Current page found.\n");
-		/*
-		 * Evaluate state and return code and call appropriate function
-		 * to faciliate processing of pages.
-		 */
-
-		switch (sd->current_page->state) {
-		case CONN:
-			gaim_debug_info("snpp", "snpp_callback: State is CONN, return code was %s\n", retcode);
-			if (!g_ascii_strcasecmp(retcode,"220"))
-				snpp_cmd_logi(sd);
-			else {
-				gaim_notify_error(gc, NULL, buf, NULL);
-				snpp_reset(gc, sd);
+	// Replies come in the order the commands went out
+	if (g_queue_is_empty(ss->expect))
+		state = IDLE;
+	else
+		state = GPOINTER_TO_INT(g_queue_pop_head(ss->expect));
+
+	/*
+	 * Evaluate state and return code and call appropriate function
+	 * to faciliate processing of pages.
+	 */
+	switch (state) {
+	case CONN:
+		gaim_debug_info("snpp", "snpp_reply: State is CONN, return code was %d\n", code);
+		if (code == 220)
+			snpp_cmd_logi(ss);
+		else
+			// Turned away at the door, as good as a failed connect
+			snpp_session_reset(ss, text, TRUE);
+		break;
+
+	case LOGI:
+		gaim_debug_info("snpp", "snpp_reply: State is LOGI, return code was %d\n", code);
+		// If LOGI is unsupported, server should return 500
+		// XXX 230 is crutch for HylaFAX breaking the protocol
+		if (code == 250 || code == 500 || code == 230) {
+			snpp_server_ok(ss->server);
+			snpp_session_ready(ss);
+		}
+		else
+			snpp_session_reset(ss, text, FALSE);
+		break;
+
+	case PAGE:
+		gaim_debug_info("snpp", "snpp_reply: State is PAGE, return code was %d\n", code);
+		sp = g_queue_peek_head(ss->pages);
+		l = sp->next;
+		sp->next = l->next;
+		if (code != 250) {
+			// Only this recipient is refused, the others still get the MESS
+			sp->pagers = g_slist_remove_link(sp->pagers, l);
+			sp->npagers--;
+			if (snpp_code_transient(code)) {
+				// Split off with an outbox record of its own
+				retry = snpp_page_new();
+				retry->pagers = l;
+				retry->npagers = 1;
+				retry->message = g_strdup(sp->message);
+				retry->queued = sp->queued;
+				retry->attempts = sp->attempts;
+				snpp_outbox_add(sd, retry);
+				snpp_outbox_drop(sd, sp, l->data);
+				snpp_page_retry(sd, retry, text);
+			} else {
+				snpp_outbox_drop(sd, sp, l->data);
+				snpp_page_report(sd, l->data, text, TRUE);
+				sd->stats.failed++;
+				g_free(l->data);
+				g_slist_free_1(l);
 			}
-			break;
+		}
 
-		case LOGI:
-			gaim_debug_info("snpp", "snpp_callback: State is LOGI, return code was %s\n", retcode);
-			// If LOGI is unsupported, server should return 500
-			// XXX 230 is crutch for HylaFAX breaking the protocol
-			if (!g_ascii_strcasecmp(retcode,"250")
-					|| !g_ascii_strcasecmp(retcode, "500")
-					|| !g_ascii_strcasecmp(retcode, "230"))
-				snpp_cmd_page(sd);
-			else {
-				gaim_notify_error(gc, NULL, buf, NULL);
-				snpp_reset(gc, sd);
-			}
+		if (sp->pipelined) {
+			// MESS and SEND are on their way already
 			break;
+		}
 
-		case PAGE:
-			gaim_debug_info("snpp", "snpp_callback: State is PAGE, return code was %s\n", retcode);
-			if (!g_ascii_strcasecmp(retcode,"250"))
-				snpp_cmd_mess(sd);
-			else {
-				gaim_notify_error(gc, NULL, buf, NULL);
-				snpp_reset(gc, sd);
-			}
+		if (sp->next != NULL)
+			snpp_cmd_page(ss, sp->next->data);
+		else if (sp->pagers != NULL)
+			snpp_cmd_body(ss);
+		else {
+			// Nobody left, everyone was told already
+			snpp_page_finish(sd, g_queue_pop_head(ss->pages), FALSE, TRUE);
+			snpp_cmd_rset(ss);
+			snpp_queue_run(sd);
+		}
+		break;
+
+	case DATA:
+		gaim_debug_info("snpp", "snpp_reply: State is DATA, return code was %d\n", code);
+		sp = g_queue_peek_head(ss->pages);
+		if (code == 354)
+			snpp_cmd_text(ss);
+		else if (sp->pagers == NULL) {
+			// Pipelined and every PAGE was refused, everyone was told
+			snpp_page_finish(sd, g_queue_pop_head(ss->pages), FALSE, TRUE);
+			snpp_cmd_rset(ss);
+			snpp_queue_run(sd);
 			break;
-
-		case MESS:
-			gaim_debug_info("snpp", "snpp_callback: State is MESS, return code was %s\n", retcode);
-			if (!g_ascii_strcasecmp(retcode,"250"))
-				snpp_cmd_send(sd);
-			else {
-				gaim_notify_error(gc, NULL, buf, NULL);
-				snpp_reset(gc, sd);
-			}
+		} else if (code == 500 || code == 502) {
+			// No DATA here (SNPP level 1), squeeze the message into MESS
+			ss->no_data = TRUE;
+			snpp_cmd_mess(ss);
+		} else {
+			snpp_page_failed(ss, code, text);
 			break;
+		}
 
-		case SEND:
-			gaim_debug_info("snpp", "snpp_callback: State is SEND, return code was %s\n", retcode);
-			if (!g_ascii_strcasecmp(retcode,"250")
-				|| !g_ascii_strcasecmp(retcode,"860")
-				|| !g_ascii_strcasecmp(retcode,"960")) {
-				// Print status message (buf) to window
-				if ((conv = gaim_find_conversation_with_account(GAIM_CONV_TYPE_IM, sd->current_page->pager, sd->account))) {
-					gaim_conversation_write(conv, NULL, buf, GAIM_MESSAGE_SYSTEM, time(NULL));
-				}
-				snpp_cmd_quit(sd);
-			} else {
-				gaim_notify_error(gc, NULL, buf, NULL);
-				snpp_reset(gc, sd);
+		if (sp->pipelined && sp->pagers != NULL)
+			snpp_cmd_send(ss);
+		break;
+
+	case MESS:
+	case TEXT:
+		gaim_debug_info("snpp", "snpp_reply: State is %s, return code was %d\n", state == MESS ? "MESS" : "TEXT", code);
+		sp = g_queue_peek_head(ss->pages);
+		if (state == TEXT && sp->pagers == NULL) {
+			// Only the text was left to finish; no SEND went out
+			snpp_page_finish(sd, g_queue_pop_head(ss->pages), FALSE, TRUE);
+			snpp_cmd_rset(ss);
+			snpp_queue_run(sd);
+		} else if (code == 250) {
+			if (!sp->pipelined)
+				snpp_cmd_send(ss);
+		} else if (sp->pipelined) {
+			// The SEND reply that follows settles the page
+			if (sp->error == NULL) {
+				sp->error = g_strdup(text);
+				sp->error_code = code;
 			}
-			break;
+		} else
+			snpp_page_failed(ss, code, text);
+		break;
+
+	case SEND:
+		gaim_debug_info("snpp", "snpp_reply: State is SEND, return code was %d\n", code);
+		sp = g_queue_peek_head(ss->pages);
+		if (sp->pagers == NULL) {
+			// Pipelined and every PAGE was refused, everyone was told
+			snpp_page_finish(sd, g_queue_pop_head(ss->pages), FALSE, TRUE);
+			snpp_cmd_rset(ss);
+			snpp_queue_run(sd);
+		} else if (sp->error != NULL)
+			snpp_page_failed(ss, sp->error_code, sp->error);
+		else if (code == 250 || code == 860 || code == 960) {
+			sp = g_queue_pop_head(ss->pages);
+			// Print status message (text) to each recipient's window
+			for (l = sp->pagers; l != NULL; l = l->next)
+				snpp_page_report(sd, l->data, text, FALSE);
+			ss->server->sent += sp->npagers;
+			snpp_page_finish(sd, sp, TRUE, TRUE);
+			snpp_queue_run(sd);
+			snpp_session_ready(ss);
+		} else
+			snpp_page_failed(ss, code, text);
+		break;
+
+	case RSET:
+		gaim_debug_info("snpp", "snpp_reply: State is RSET, return code was %d\n", code);
+		if (code == 250)
+			snpp_session_ready(ss);
+		else
+			snpp_session_reset(ss, NULL, FALSE);
+		break;
+
+	case QUIT:
+		gaim_debug_info("snpp", "snpp_reply: State is QUIT, return code was %d\n", code);
+
+		if (code != 221)
+			gaim_debug_info("snpp", "snpp_reply: Return code of 221 expected, not received\n");
+
+		snpp_session_close(ss);
+
+		// Pages may have come in while we were saying goodbye
+		if (!g_queue_is_empty(ss->pages))
+			snpp_connect(ss);
+		break;
+
+	case IDLE:
+		// Nothing outstanding, most likely a 421 before the server hangs up
+		gaim_debug_info("snpp", "snpp_reply: Unsolicited reply while idle: %s\n", text);
+		snpp_session_close(ss);
+		break;
+
+	default:
+		gaim_debug_info("snpp", "snpp_reply: session in unknown state\n");
+		gaim_notify_error(sd->gc, NULL, text, NULL);
+	}
+};
+
+/*
+ * Cut the next complete reply out of the input buffer, starting at *pos.
+ * A multi-line reply ("214-...") runs to the first line with a space after
+ * the code. The reply is NUL-terminated in place and *pos moved past it.
+ * Returns the code, 0 if the reply doesn't start with one, and -1 while
+ * the reply is still incomplete.
+ */
+static int snpp_reply_next(GString *inbuf, gsize *pos, char **text)
+{
+	char *start = inbuf->str + *pos;
+	char *end = inbuf->str + inbuf->len;
+	char *line, *eol;
+
+	for (line = start; (eol = memchr(line, '\n', end - line)) != NULL; line = eol + 1) {
+		if (eol - line > 3 && line[3] == '-'
+				&& g_ascii_isdigit(line[0]) && g_ascii_isdigit(line[1]) && g_ascii_isdigit(line[2]))
+			continue;
+
+		*pos = eol + 1 - inbuf->str;
+		if (eol > start && eol[-1] == '\r')
+			eol--;
+		*eol = '\0';
+		*text = start;
+
+		if (!g_ascii_isdigit(start[0]) || !g_ascii_isdigit(start[1]) || !g_ascii_isdigit(start[2]))
+			return 0;
+		return (start[0] - '0') * 100 + (start[1] - '0') * 10 + (start[2] - '0');
+	}
 
-		case QUIT:
-			// Not sure if we should ever get here
-			gaim_debug_info("snpp", "snpp_callback: State is QUIT, return code was %s\n", retcode);
+	return -1;
+};
 
-			if (g_ascii_strcasecmp(retcode,"221"))
-				gaim_debug_info("snpp", "snpp_callback: Return code of 221 expected, not received\n");
+static void snpp_callback(gpointer data, gint source, GaimInputCondition cond)
+{
+	struct snpp_session *ss;
+	gsize used, pos;
+	guint generation;
+	char *text;
+	int code;
+	int len;
 
-			snpp_reset(gc, sd);
-			break;
+	gaim_debug_info("snpp", "snpp_callback\n");
 
-		default:
-			gaim_debug_info("snpp", "snpp_callback: current_page in unknown state\n");
-			gaim_notify_error(gc, NULL, buf, NULL);
-		}
+	ss = data;
 
-	} else {
-		gaim_debug_info("snpp", "snpp_callback: No current page to process\n");
+	used = ss->inbuf->len;
+	g_string_set_size(ss->inbuf, used + SNPP_INITIAL_BUFSIZE);
+	len = read(ss->fd, ss->inbuf->str + used, SNPP_INITIAL_BUFSIZE);
+	g_string_set_size(ss->inbuf, used + MAX(len, 0));
+
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		gaim_debug_warning("snpp", "snpp_callback: Read error\n");
+		snpp_session_reset(ss, _("Read error"), TRUE);
+		return;
+	} else if (len == 0) {
+		/* Remote closed the connection, probably on its own idle timeout */
+		gaim_debug_info("snpp", "snpp_callback: Server closed the session\n");
+		if (ss->state == IDLE || ss->state == QUIT) {
+			snpp_session_close(ss);
+			if (!g_queue_is_empty(ss->pages))
+				snpp_connect(ss);
+		} else
+			snpp_session_reset(ss, _("SNPP server closed the connection"), TRUE);
+		return;
 	}
 
-	g_free(retcode);
+	/* Every reply that arrived in full, in order; stop if one ends the session */
+	pos = 0;
+	generation = ss->generation;
+	while (ss->generation == generation && (code = snpp_reply_next(ss->inbuf, &pos, &text)) >= 0)
+		snpp_reply(ss, code, text);
+
+	if (ss->generation != generation)
+		return;
+
+	g_string_erase(ss->inbuf, 0, pos);
+	if (ss->inbuf->len > SNPP_MAX_REPLY) {
+		gaim_debug_warning("snpp", "snpp_callback: Reply longer than %d bytes\n", SNPP_MAX_REPLY);
+		snpp_session_reset(ss, _("SNPP server sent an overlong reply"), FALSE);
+	}
 };
 
 static void snpp_connect_cb(gpointer data, gint source, GaimInputCondition cond)
 {
-	GaimConnection *gc;
-	struct snpp_data *sd;
-	GList *connections;
+	struct snpp_session *ss;
 
 	gaim_debug_info("snpp", "snpp_connect_cb\n");
 
-	gc = data;
-	sd = gc->proto_data;
-	connections = gaim_connections_get_all();
-
-	if (source < 0)
+	ss = data;
+
+	if (ss->sd == NULL) {
+		// The account went away while we were connecting
+		if (source >= 0)
+			close(source);
+		g_string_free(ss->inbuf, TRUE);
+		g_queue_free(ss->outq);
+		g_queue_free(ss->expect);
+		g_queue_free(ss->pages);
+		g_free(ss);
 		return;
+	}
 
-	if (!g_list_find(connections, gc)) {
-		close(source);
+	if (source < 0) {
+		snpp_session_reset(ss, _("Couldn't connect to SNPP server"), TRUE);
 		return;
 	}
 
-	sd->fd = source;
+	ss->fd = source;
+	fcntl(ss->fd, F_SETFL, fcntl(ss->fd, F_GETFL) | O_NONBLOCK);
 
-	gc->inpa = gaim_input_add(sd->fd, GAIM_INPUT_READ, snpp_callback, gc);
+	// The greeting is the first reply
+	g_queue_push_tail(ss->expect, GINT_TO_POINTER(CONN));
+	ss->inpa = gaim_input_add(ss->fd, GAIM_INPUT_READ, snpp_callback, ss);
 }
 
-static void snpp_connect(GaimConnection *gc)
+static void snpp_connect(struct snpp_session *ss)
 {
+	GaimConnection *gc = ss->sd->gc;
 	int err;
 
 	gaim_debug_info("snpp", "snpp_connect\n");
 
+	ss->state = CONN;
 	err = gaim_proxy_connect(gc->account,
-			gaim_account_get_string(gc->account, "server", SNPP_DEFAULT_SERVER),
-			gaim_account_get_int(gc->account, "port", SNPP_DEFAULT_PORT),
+			ss->server->host,
+			ss->server->port,
 			snpp_connect_cb,
-			gc);
+			ss);
 
 	if (err || !gc->account->gc) {
-		gaim_connection_error(gc, _("Couldn't connect to SNPP server"));
+		snpp_session_reset(ss, _("Couldn't connect to SNPP server"), TRUE);
 		return;
 	}
 };
 
 
-static int snpp_process(GaimConnection *gc, struct snpp_data *sd)
+static int snpp_queue_page(struct snpp_data *sd, struct snpp_page *sp)
 {
-	gaim_debug_info("snpp", "snpp_process\n");
+	guint depth;
 
-	if (sd->current_page->message && (strlen(sd->current_page->message) > 0)) {
-		/* Just completed proxy_connect, ready to send data to server */
-		gaim_debug_info("snpp", "snpp_page: Sending SNPP Request:\n\n%s\n\n", sd->current_page->message);
+	gaim_debug_info("snpp", "snpp_queue_page\n");
 
-		/* Get ball rolling, snpp_callback will take over */
-		snpp_connect(gc);
+	if (sp->message == NULL || strlen(sp->message) == 0 || sp->pagers == NULL) {
+		snpp_page_destroy(sp);
+		return 0;
 	}
 
+	gaim_debug_info("snpp", "snpp_page: Queueing SNPP Request:\n\n%s\n\n", sp->message);
+
+	snpp_outbox_add(sd, sp);
+	g_queue_push_tail(sd->queue, sp);
+	sd->stats.queued += sp->npagers;
+	depth = g_queue_get_length(sd->queue);
+	if (depth > sd->stats.max_depth)
+		sd->stats.max_depth = depth;
+
+	return 1;
+};
+
+static int snpp_process(GaimConnection *gc, struct snpp_data *sd, struct snpp_page *sp)
+{
+	gaim_debug_info("snpp", "snpp_process\n");
+
+	if (!snpp_queue_page(sd, sp))
+		return 0;
+
+	snpp_queue_run(sd);
+
 	return 1;
 };
 
@@ -394,11 +1843,10 @@ static int snpp_send_im(GaimConnection *gc,
 	sd = gc->proto_data;
 	sp = snpp_page_new();
 
-	sp->pager = g_strdup(who);
+	snpp_page_add_pager(sp, who);
 	sp->message = g_strdup(what);
 
-	sd->current_page = sp;
-	snpp_process(gc, sd);
+	snpp_process(gc, sd, sp);
 
 	return 1;
 };
@@ -410,22 +1858,77 @@ static const char *snpp_icon(GaimAccount *a, GaimBuddy *b)
 	return "snpp";
 }
 
-static void fake_buddy_signons(GaimAccount *account)
+/*
+ * Pager buddies by account, a set of GaimBuddy nodes per account. One
+ * blist walk fills an account's set the first time it connects. After
+ * that the blist's buddy-added and buddy-removed signals keep it current,
+ * whoever changes the list and whether or not the account is online, so
+ * later logins never look at the rest of the buddy list. snpp_add_buddy
+ * and snpp_remove_buddy update it too; adding twice is harmless.
+ */
+static GHashTable *snpp_buddy_index = NULL;
+
+static GHashTable *snpp_buddies(GaimAccount *account)
 {
-	GaimBlistNode *node = gaim_get_blist()->root;
+	GHashTable *buddies;
+	GaimBlistNode *node;
 
-	while (node != NULL)
-	{
-		if (GAIM_BLIST_NODE_IS_BUDDY(node))
-		{
-			GaimBuddy *buddy = (GaimBuddy *)node;
-			if (buddy->account == account)
-				gaim_prpl_got_user_status(account, buddy->name, "available", NULL);
-		}
+	if (snpp_buddy_index == NULL)
+		snpp_buddy_index = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, (GDestroyNotify)g_hash_table_destroy);
+
+	if ((buddies = g_hash_table_lookup(snpp_buddy_index, account)) != NULL)
+		return buddies;
 
-		node = gaim_blist_node_next(node, FALSE);
+	gaim_debug_info("snpp", "snpp_buddies: Indexing %s\n", gaim_account_get_username(account));
+
+	buddies = g_hash_table_new(g_direct_hash, g_direct_equal);
+	g_hash_table_insert(snpp_buddy_index, account, buddies);
+
+	for (node = gaim_get_blist()->root; node != NULL; node = gaim_blist_node_next(node, FALSE)) {
+		if (GAIM_BLIST_NODE_IS_BUDDY(node) && ((GaimBuddy *)node)->account == account)
+			g_hash_table_replace(buddies, node, node);
 	}
 
+	return buddies;
+};
+
+/* Only sets already built are kept up, the first walk picks up the rest */
+static void snpp_buddy_added(GaimBuddy *buddy, gpointer data)
+{
+	GHashTable *buddies;
+
+	if (snpp_buddy_index != NULL && (buddies = g_hash_table_lookup(snpp_buddy_index, buddy->account)) != NULL)
+		g_hash_table_replace(buddies, buddy, buddy);
+};
+
+static void snpp_buddy_removed(GaimBuddy *buddy, gpointer data)
+{
+	GHashTable *buddies;
+
+	if (snpp_buddy_index != NULL && (buddies = g_hash_table_lookup(snpp_buddy_index, buddy->account)) != NULL)
+		g_hash_table_remove(buddies, buddy);
+};
+
+static void snpp_account_removed(GaimAccount *account, gpointer data)
+{
+	if (snpp_buddy_index != NULL)
+		g_hash_table_remove(snpp_buddy_index, account);
+};
+
+static void snpp_buddy_signon(gpointer key, gpointer value, gpointer data)
+{
+	GaimBuddy *buddy = key;
+
+	gaim_prpl_got_user_status(buddy->account, buddy->name, "available", NULL);
+};
+
+static void fake_buddy_signons(GaimAccount *account)
+{
+	GHashTable *buddies = snpp_buddies(account);
+
+	gaim_debug_info("snpp", "fake_buddy_signons: %u buddies\n", g_hash_table_size(buddies));
+
+	g_hash_table_foreach(buddies, snpp_buddy_signon, NULL);
 }
 
 static void snpp_login(GaimAccount *account)
@@ -437,17 +1940,26 @@ static void snpp_login(GaimAccount *account)
 
 	gc = gaim_account_get_connection(account);
 	gc->proto_data = sd = g_new0(struct snpp_data, 1);
+	sd->gc = gc;
 	sd->account = account;
+	sd->queue = g_queue_new();
+	sd->retries = g_queue_new();
+	snpp_servers_init(sd);
+	snpp_outbox_open(sd);
 
 	gaim_connection_set_state(gc, GAIM_CONNECTED);
 
 	fake_buddy_signons(account);
+
+	// Pages left over from the last session, in one pipelined batch
+	snpp_queue_run(sd);
 };
 
 
 static void snpp_close(GaimConnection *gc)
 {
 	struct snpp_data *sd;
+	struct snpp_page *sp;
 	gaim_debug_info("snpp", "snpp_close\n");
 
 	sd = gc->proto_data;
@@ -455,19 +1967,31 @@ static void snpp_close(GaimConnection *gc)
 	if (sd == NULL)
 		return;
 
-	snpp_reset(gc, sd);
+	snpp_servers_free(sd);
+	snpp_retry_free(sd);
+	snpp_outbox_close(sd);
+
+	while ((sp = g_queue_pop_head(sd->queue)) != NULL)
+		snpp_page_destroy(sp);
+	g_queue_free(sd->queue);
+
 	g_free(sd);
+	gc->proto_data = NULL;
 };
 
 static void snpp_add_buddy(GaimConnection *gc, GaimBuddy *b, GaimGroup *group)
 {
+	GaimAccount *account = gaim_connection_get_account(gc);
+
 	gaim_debug_info("snpp", "snpp_add_buddy\n");
-	gaim_prpl_got_user_status(gaim_connection_get_account(gc), b->name, "available", NULL);
+	g_hash_table_replace(snpp_buddies(account), b, b);
+	gaim_prpl_got_user_status(account, b->name, "available", NULL);
 };
 
 static void snpp_remove_buddy(GaimConnection *gc, GaimBuddy *b, GaimGroup *group)
 {
 	gaim_debug_info("snpp", "snpp_remove_buddy\n");
+	snpp_buddy_removed(b, NULL);
 };
 
 static GList *snpp_status_types(GaimAccount *account)
@@ -486,6 +2010,117 @@ static GList *snpp_status_types(GaimAccount *account)
 	return types;
 }
 
+static void snpp_show_queue(GaimPluginAction *action)
+{
+	GaimConnection *gc = action->context;
+	struct snpp_data *sd = gc->proto_data;
+	struct snpp_stats *stats;
+	struct snpp_server *sv;
+	GString *str;
+	GList *l;
+
+	gaim_debug_info("snpp", "snpp_show_queue\n");
+
+	if (sd == NULL)
+		return;
+
+	stats = &sd->stats;
+	str = g_string_new(NULL);
+	g_string_append_printf(str, "<b>%s</b> %u<br>", _("Waiting:"), g_queue_get_length(sd->queue));
+	g_string_append_printf(str, "<b>%s</b> %u<br>", _("In flight:"), sd->inflight);
+	g_string_append_printf(str, "<b>%s</b> %u backing off, %lu retries, %lu given up, %lu recipients uncertain<br>", _("Retries:"),
+			g_queue_get_length(sd->retries), stats->retried, stats->gave_up, stats->uncertain);
+	g_string_append_printf(str, "<b>%s</b> %u<br>", _("Longest queue:"), stats->max_depth);
+	g_string_append_printf(str, "<b>%s</b> %lu queued, %lu sent, %lu failed<br>", _("Recipients:"),
+			stats->queued, stats->sent, stats->failed);
+	g_string_append_printf(str, "<b>%s</b> %lu<br>", _("Identical pages merged:"), stats->merged);
+	g_string_append_printf(str, "<b>%s</b> %u unfinished, %lu replayed at login, %lu syncs<br>", _("Outbox:"),
+			sd->outbox_pending, stats->replayed, stats->syncs);
+	g_string_append_printf(str, "<b>%s</b> %lu ms average, %lu ms max<br>", _("Wait before PAGE:"),
+			stats->waited ? stats->wait_total / stats->waited : 0, stats->wait_max);
+
+	for (l = sd->servers; l != NULL; l = l->next) {
+		sv = l->data;
+		g_string_append_printf(str, "<b>%s:%d</b> %s, %u outstanding, %lu sent, %u failures in a row, breaker opened %lu times<br>",
+				sv->host, sv->port,
+				sv->breaker == BREAKER_CLOSED ? _("up") : sv->breaker == BREAKER_OPEN ? _("down") : _("checking"),
+				snpp_server_outstanding(sv), sv->sent, sv->failures, sv->trips);
+	}
+
+	gaim_notify_formatted(gc, _("SNPP Page Queue"), _("SNPP Page Queue"), NULL, str->str, NULL, NULL);
+	g_string_free(str, TRUE);
+}
+
+static void snpp_multi_page_cb(GaimConnection *gc, GaimRequestFields *fields)
+{
+	struct snpp_data *sd = gc->proto_data;
+	const char *message;
+	struct snpp_page *sp;
+	gchar **pagers;
+	int i;
+
+	gaim_debug_info("snpp", "snpp_multi_page_cb\n");
+
+	if (sd == NULL)
+		return;
+
+	message = gaim_request_fields_get_string(fields, "message");
+	pagers = g_strsplit_set(gaim_request_fields_get_string(fields, "pagers"), " ,;\t\r\n", -1);
+
+	/*
+	 * One page per recipient, all queued before the queue runs: the first
+	 * to start merges the rest into batches of SNPP_MAX_RECIPIENTS.
+	 */
+	for (i = 0; pagers[i] != NULL; i++) {
+		if (*pagers[i] == '\0')
+			continue;
+
+		sp = snpp_page_new();
+		snpp_page_add_pager(sp, pagers[i]);
+		sp->message = g_strdup(message);
+		snpp_queue_page(sd, sp);
+	}
+	g_strfreev(pagers);
+
+	snpp_queue_run(sd);
+}
+
+static void snpp_multi_page(GaimPluginAction *action)
+{
+	GaimConnection *gc = action->context;
+	GaimRequestFields *fields;
+	GaimRequestFieldGroup *group;
+	GaimRequestField *field;
+
+	gaim_debug_info("snpp", "snpp_multi_page\n");
+
+	fields = gaim_request_fields_new();
+	group = gaim_request_field_group_new(NULL);
+	gaim_request_fields_add_group(fields, group);
+
+	field = gaim_request_field_string_new("pagers", _("Pager IDs"), NULL, TRUE);
+	gaim_request_field_set_required(field, TRUE);
+	gaim_request_field_group_add_field(group, field);
+
+	field = gaim_request_field_string_new("message", _("Message"), NULL, TRUE);
+	gaim_request_field_set_required(field, TRUE);
+	gaim_request_field_group_add_field(group, field);
+
+	gaim_request_fields(gc, _("Page Several Recipients"), _("Page Several Recipients"),
+			_("Pager IDs may be separated by commas, spaces or new lines."), fields,
+			_("Send"), G_CALLBACK(snpp_multi_page_cb),
+			_("Cancel"), NULL, gc);
+}
+
+static GList *snpp_actions(GaimPlugin *plugin, gpointer context)
+{
+	GList *m = NULL;
+
+	m = g_list_append(m, gaim_plugin_action_new(_("Page Several Recipients..."), snpp_multi_page));
+	m = g_list_append(m, gaim_plugin_action_new(_("Show Page Queue"), snpp_show_queue));
+	return m;
+}
+
 static GaimPluginProtocolInfo prpl_info =
 {
 	OPT_PROTO_PASSWORD_OPTIONAL,	/* options		  */
@@ -548,6 +2183,30 @@ static GaimPluginProtocolInfo prpl_info =
 };
 
 
+static gboolean snpp_load(GaimPlugin *plugin)
+{
+	gaim_debug_info("snpp", "snpp_load\n");
+
+	gaim_signal_connect(gaim_blist_get_handle(), "buddy-added", plugin, GAIM_CALLBACK(snpp_buddy_added), NULL);
+	gaim_signal_connect(gaim_blist_get_handle(), "buddy-removed", plugin, GAIM_CALLBACK(snpp_buddy_removed), NULL);
+	gaim_signal_connect(gaim_accounts_get_handle(), "account-removed", plugin, GAIM_CALLBACK(snpp_account_removed), NULL);
+
+	return TRUE;
+};
+
+static gboolean snpp_unload(GaimPlugin *plugin)
+{
+	gaim_debug_info("snpp", "snpp_unload\n");
+
+	gaim_signals_disconnect_by_handle(plugin);
+	if (snpp_buddy_index != NULL) {
+		g_hash_table_destroy(snpp_buddy_index);
+		snpp_buddy_index = NULL;
+	}
+
+	return TRUE;
+};
+
 static GaimPluginInfo info =
 {
 	GAIM_PLUGIN_MAGIC,
@@ -565,13 +2224,13 @@ static GaimPluginInfo info =
 	N_("Allows Gaim to send messages over the Simple Network Paging Protocol."),	/* description	*/
 	N_("Don Seiler <don@seiler.us>"),	/* author		*/
 	SNPP_WEBSITE,					/* homepage			*/
-	NULL,							/* load				*/
-	NULL,							/* unload			*/
+	snpp_load,						/* load				*/
+	snpp_unload,					/* unload			*/
 	NULL,							/* destroy			*/
 	NULL,							/* ui_info			*/
 	&prpl_info,						/* extra_info		*/
 	NULL,							/* prefs_info		*/
-	NULL							/* actions			*/
+	snpp_actions					/* actions			*/
 };
 
 
@@ -584,6 +2243,18 @@ static void _init_plugin(GaimPlugin *plugin)
 	option = gaim_account_option_int_new(_("Port"), "port", SNPP_DEFAULT_PORT);
 	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
 
+	option = gaim_account_option_string_new(_("More servers (host:port, ...)"), "servers", "");
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+	option = gaim_account_option_int_new(_("Idle timeout (seconds)"), "idle_timeout", SNPP_DEFAULT_IDLE_TIMEOUT);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+	option = gaim_account_option_int_new(_("Pages in flight"), "max_inflight", SNPP_DEFAULT_MAX_INFLIGHT);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
+	option = gaim_account_option_bool_new(_("Pipeline commands"), "pipeline", TRUE);
+	prpl_info.protocol_options = g_list_append(prpl_info.protocol_options, option);
+
 	_snpp_plugin = plugin;
 };
 